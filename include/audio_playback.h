@@ -11,17 +11,30 @@
 #define CHANNELS 2
 #define BLOCK_SIZE (SAMPLE_NO * CHANNELS * sizeof(int16_t))
 
+#define FRAMES_TO_US(frames) ((uint32_t)((uint64_t)(frames) * 1000000 / SAMPLE_RATE))
+// Play time of a full block. Blocks carry what one packet decoded to, so
+// most are shorter (20 ms from a default opusenc stream).
+#define BLOCK_US FRAMES_TO_US(SAMPLE_NO)
+
 #define I2S_DEV DT_NODELABEL(i2s3)
 
 int stream_opus(const char *path, const struct adc_dt_spec *adc_chan);
 int init_audio_playback();
 
 void audio_handler_thread(void *pipeP, void *arg2, void *arg3);
+// Library id of the track being played, UINT32_MAX when stopped
+uint32_t audio_now_playing(void);
+// Whether the play order is shuffled, restored from RESUME.DAT at boot
+bool audio_shuffled(void);
 
-enum message_type {PLAY, PAUSE, RESUME, VOL, DEF};
+enum message_type {PLAY, PAUSE, RESUME, VOL, SEEK, NEXT, PREV, SHUFFLE, CROSSFADE, DEF};
 
 typedef struct {
     enum message_type msg_type;
     int volume;
-    char song_path[64];
+    uint32_t position_ms;
+    uint32_t track_id; // Position in LIBRARY.IDX
+    bool shuffle;
+    uint32_t duration_ms; // Crossfade length, 0 turns it off
+    int64_t sent_ticks; // k_uptime_ticks() when sent, for the transport latency probe
 } audio_thread_msg;
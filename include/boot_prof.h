@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+enum boot_phase {
+    BOOT_MAIN,          // main() entered
+    BOOT_AUDIO_READY,   // Decoder, SAI and codec initialised
+    BOOT_DISPLAY_READY, // Display up and screen drawn
+    BOOT_DISK_READY,    // SD card mounted
+    BOOT_RESUME_LOADED, // Last played track looked up
+    BOOT_FIRST_AUDIO,   // First decoded block handed to the DMA
+    BOOT_LIBRARY_READY, // File list populated
+    BOOT_PHASE_COUNT
+};
+
+// Records the uptime of a phase the first time it is reached. The profile is
+// logged once every phase has been seen.
+void boot_mark(enum boot_phase phase);
@@ -0,0 +1,30 @@
+#pragma once
+
+// On-card file layout written by tools/cardprep and relied on by the player.
+
+#include <stdint.h>
+
+#define CARD_SECTOR_SIZE 512
+// Audio pages are grown to whole sectors, up to roughly this size
+#define CARD_PAGE_TARGET (8 * CARD_SECTOR_SIZE)
+// Size of the player's packet buffer, padding never grows a packet past it
+#define CARD_MAX_PACKET 1275
+
+// Seek table stored as the binary trailer of OpusTags (RFC 7845 5.2). The
+// leading byte has its LSB set so tag editors preserve it.
+#define SEEK_TABLE_MAGIC     "\x01STSK"
+#define SEEK_TABLE_MAGIC_LEN 5
+#define SEEK_TABLE_VERSION   1
+#define SEEK_TABLE_INTERVAL  48000 // One entry per second of audio
+
+struct seek_table_header {
+    char magic[SEEK_TABLE_MAGIC_LEN];
+    uint8_t version;
+    uint16_t count;
+    uint32_t interval;
+} __attribute__((packed));
+
+struct seek_table_entry {
+    uint32_t granule; // Granule position of the first sample on the page
+    uint32_t offset;  // Byte offset of the page from the first audio page
+} __attribute__((packed));
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <zephyr/timing/timing.h>
+
+// Set to 1 to printk a "gov,<work_us>,<block_us>,<in_flight>,<level>" line per
+// block, the format tools/govsim replays
+#define GOVERNOR_TRACE 0
+
+#define GOVERNOR_REPORT_BLOCKS 1000
+
+int clock_governor_init(void);
+// Back to full speed, used when a new stream starts
+void clock_governor_reset(void);
+// Called by the audio thread after every block handed to the DMA, with the
+// time it took to produce and how many frames it plays for
+void clock_governor_block(uint32_t work_us, uint32_t frames, uint32_t in_flight);
+
+// Wall time between two timing_counter_get() stamps. Work is timed with the
+// DWT cycle counter, the kernel timer runs from the LSI and only resolves
+// ~30 us. The counter follows the core clock, so cycles are scaled by the
+// divider in force.
+uint32_t clock_governor_work_us(timing_t start, timing_t end);
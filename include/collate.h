@@ -0,0 +1,31 @@
+#pragma once
+
+// Sort keys for the library's search tables. Has no Zephyr dependencies so
+// tools/cardprep builds the tables with the same rules the player searches
+// them with.
+//
+// Keys are UTF-8 and compare with memcmp. Latin is case and accent folded,
+// full width forms become ASCII and katakana (full or half width) becomes
+// hiragana, so kana sorts in gojuon order. Half width and combining voicing
+// marks are composed, ｶﾞ sorts as が. Kanji has no reading to sort by
+// on its own, cardprep uses the TITLESORT / ARTISTSORT / ALBUMSORT tags
+// instead when a track has them.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COLLATE_KEY_MAX 128
+
+// Jump targets: #, A-Z, everything between Latin and kana (other scripts,
+// symbols, CJK punctuation), the ten kana rows and everything after kana
+#define COLLATE_JUMP_COUNT 39
+
+extern const char *const collate_jump_labels[COLLATE_JUMP_COUNT];
+
+// Decodes the codepoint at *p and moves *p past it. A truncated or malformed
+// sequence gives U+FFFD and moves past the bytes read, never past a NUL.
+uint32_t collate_utf8_decode(const uint8_t **p);
+// Writes the key for text to out, returns its length
+size_t collate_key(const char *text, uint8_t *out, size_t cap);
+// Bucket a key falls in, buckets are contiguous in key order
+int collate_jump_bucket(const uint8_t *key, size_t len);
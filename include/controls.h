@@ -0,0 +1,35 @@
+#pragma once
+
+// The player's two inputs: the potentiometer and one push button (gpio-keys
+// node "buttons" in app.overlay). The button is decoded into clicks, double
+// clicks and long presses, a long press steps through the modes below and
+// the knob and clicks mean something different in each.
+//
+//   Play       knob volume, click pause/resume, double click next
+//   Seek       knob picks a position in the track, click seeks there, double click prev
+//   Browse     knob scrolls the titles (further from where it started is faster),
+//              click plays the highlighted one
+//   Jump       knob picks a letter or kana row, click jumps there and goes to Browse
+//   Search     knob picks a character, click adds it (or deletes with <) and
+//              highlights the first title starting with the text, double click plays it
+//   Shuffle    click turns shuffle on or off
+//   Crossfade  knob picks 0-12 s between tracks, click sets it
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+#include <lvgl.h>
+
+// Presses closer together than this make a double click
+#define CONTROLS_DOUBLE_CLICK_MS 300
+#define CONTROLS_LONG_PRESS_MS 700
+
+// Potentiometer ADC counts, 12 bit
+#define CONTROLS_KNOB_MAX 4095
+// Counts the knob has to move before the volume is resent
+#define CONTROLS_VOL_DEADBAND 16
+
+// Commands go to the audio thread through pipe, status is shown in label and
+// list is the title list from populate_list_with_files
+void controls_init(struct k_pipe *pipe, lv_obj_t *label, lv_obj_t *list);
+// Called from the UI loop with the latest potentiometer reading
+void controls_update(uint16_t knob);
@@ -0,0 +1,46 @@
+#pragma once
+
+// Crossfade between consecutive tracks. When the playing track gets within
+// the fade length of its end it is handed over here with its file, Ogg state
+// and a copy of its decoder state, the audio thread starts the next track as
+// normal and every block it decodes is mixed with the outgoing one using
+// equal power gains. The second decoder and its buffers come out of a fixed
+// heap that is emptied again when the fade ends.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/fs/fs.h>
+#include <opus.h>
+
+#include "opus_file.h"
+
+// Fixed point stereo decoder (~18 KiB) plus a packet and one block of PCM
+#define CROSSFADE_HEAP_SIZE (40 * 1024)
+#define CROSSFADE_MAX_MS 12000
+
+// Dual decode cost, for sizing the worst case against the block deadline.
+// A peak is the block of a fade that came closest to its deadline, the time
+// it plays for: decoding the incoming track, the outgoing one and mixing them.
+struct crossfade_stats {
+    uint32_t fades; // Fades that ran to the end
+    uint32_t last_peak_us;
+    uint32_t last_block_us;
+    uint32_t worst_peak_us;
+    uint32_t worst_block_us;
+};
+
+void crossfade_init(void);
+
+// Takes ownership of the outgoing track, file and state are copied out and
+// must not be used by the caller afterwards. Fails if the budget is exhausted.
+int crossfade_begin(struct fs_file_t *file, const opus_state_t *st, const OpusDecoder *dec,
+                    uint32_t discard, uint32_t fade_samples);
+bool crossfade_active(void);
+// Mixes the next frames of the outgoing track under the incoming audio in
+// block. primary_us is what producing the incoming audio cost, used for the
+// dual decode peak. Returns the time spent on the outgoing track.
+uint32_t crossfade_apply(int16_t *block, uint32_t frames, uint32_t primary_us);
+// Drops the outgoing track, used on skip, seek and stop
+void crossfade_cancel(void);
+
+void crossfade_get_stats(struct crossfade_stats *out);
@@ -0,0 +1,51 @@
+#pragma once
+
+// Bitmap font file streamed from the card by the player's SD font driver,
+// written by tools/fontpack. All integers are little endian.
+//
+//   header
+//   page table   uint32 first codepoint of every index page
+//   index        glyph entries sorted by codepoint, starts sector aligned
+//   bitmaps      1bpp rows, MSB first, each row padded to a whole byte
+//
+// Index pages are one sector each so any glyph is found with a single read
+// once the page table is in RAM.
+
+#include <stdint.h>
+
+#include "card_layout.h"
+
+#define FONT_FILE_NAME    "GLYPHS.STF"
+#define FONT_FILE_MAGIC   "STFN"
+#define FONT_FILE_VERSION 1
+
+// Glyphs larger than this are rejected by fontpack, it bounds the cache slots
+#define FONT_MAX_GLYPH_DIM   16
+#define FONT_MAX_GLYPH_BYTES (FONT_MAX_GLYPH_DIM * ((FONT_MAX_GLYPH_DIM + 7) / 8))
+
+struct font_file_header {
+    char magic[4];
+    uint16_t version;
+    uint8_t bpp;          // Always 1 for now
+    uint8_t line_height;
+    uint8_t base_line;    // Pixels from the bottom of the line to the baseline
+    uint8_t default_adv;  // Advance most glyphs share, used until a glyph is loaded
+    uint16_t reserved;
+    uint32_t glyph_count;
+    uint32_t pages_offset;
+    uint32_t index_offset;
+    uint32_t bitmaps_offset;
+} __attribute__((packed));
+
+struct font_file_glyph {
+    uint32_t codepoint;
+    uint32_t bitmap; // Offset from bitmaps_offset
+    uint8_t adv_w;
+    uint8_t box_w;
+    uint8_t box_h;
+    int8_t ofs_x;
+    int8_t ofs_y;    // Bottom of the box relative to the baseline, up is positive
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+#define FONT_GLYPHS_PER_PAGE (CARD_SECTOR_SIZE / sizeof(struct font_file_glyph))
@@ -0,0 +1,45 @@
+#pragma once
+
+// Clock governor decision logic. Plain C with no Zephyr dependencies so it
+// can be replayed against recorded load traces on the host (tools/govsim).
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define GOV_LEVEL_COUNT 3
+
+// System clock divider for every level, level 0 is full speed
+extern const uint8_t gov_dividers[GOV_LEVEL_COUNT];
+
+struct gov_config {
+    uint16_t up_load;     // Step up once the peak load at the current level exceeds this
+    uint16_t down_load;   // Step down only if the peak load one level lower stays under this
+    uint16_t hold_blocks; // Blocks the step down condition has to hold
+    uint16_t peak_decay;  // Peak load decay per block, in 1/1024ths
+};
+
+// Loads are in basis points of the block period (10000 = 100%)
+#define GOV_CONFIG_DEFAULT {   \
+    .up_load = 6500,           \
+    .down_load = 4500,         \
+    .hold_blocks = 32,         \
+    .peak_decay = 8,           \
+}
+
+struct gov_state {
+    struct gov_config cfg;
+    uint8_t level;
+    uint16_t calm_blocks;
+    uint32_t peak_load; // Full speed equivalent
+
+    uint32_t blocks;
+    uint32_t misses;
+    uint32_t level_blocks[GOV_LEVEL_COUNT];
+};
+
+void gov_init(struct gov_state *st, const struct gov_config *cfg);
+
+// Feeds one block: the time spent producing it at the current level, the
+// block period and how many blocks the DMA still had queued when it was
+// handed over (0 means it ran dry). Returns the level to run the next block at.
+uint8_t gov_update(struct gov_state *st, uint32_t work_us, uint32_t block_us, uint32_t in_flight);
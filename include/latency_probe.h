@@ -0,0 +1,35 @@
+#pragma once
+
+// Transport command latency, from the moment a command is sent to the moment
+// the first block carrying its effect starts to play. Plain C with no Zephyr
+// dependencies so the audio thread's block loop can be simulated against it
+// on the host (tools/latsim). Times are in microseconds on any monotonic clock.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The block being decoded when a command is read and the one already queued
+// ahead of it both play first, plus slack for a 10 ms pause block
+#define LATENCY_BOUND_US(block_us) (2 * (block_us) + 10000)
+
+struct latency_probe {
+    int64_t command_us;
+    bool command_pending;
+    // Blocks ahead of the response block, -1 when nothing is being measured
+    int32_t response_ahead;
+
+    uint32_t worst_us;
+    uint32_t responses;
+};
+
+void latency_probe_init(struct latency_probe *p);
+// Drops a measurement in progress, used when playback restarts
+void latency_probe_cancel(struct latency_probe *p);
+// A command sent at sent_us has been acted on, a later one replaces it
+void latency_probe_command(struct latency_probe *p, int64_t sent_us);
+// The block just queued carries the response, with ahead blocks queued before
+// it. Returns true and the latency if it plays straight away.
+bool latency_probe_response(struct latency_probe *p, uint32_t ahead, int64_t now_us, uint32_t *latency_us);
+// A queued block finished playing. Returns true and the latency when that
+// makes the response block audible.
+bool latency_probe_block_played(struct latency_probe *p, int64_t now_us, uint32_t *latency_us);
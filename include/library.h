@@ -0,0 +1,44 @@
+#pragma once
+
+// Reads tracks out of the LIBRARY.IDX written by tools/cardprep. Tracks are
+// addressed by their position in the index, ordered by path.
+//
+// The sorted title, artist and album tables are walked with a cursor. Only
+// the blocks a lookup touches are read, a few recent ones are cached.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "library_index.h"
+
+#define LIBRARY_INDEX_PATH "/SD:/" LIBRARY_INDEX_NAME
+#define LIBRARY_PATH_MAX 128
+
+struct library_cursor {
+    uint8_t field; // enum library_sort_field
+    uint32_t block;
+    uint16_t index;
+};
+
+int library_open(void);
+uint32_t library_count(void);
+
+int library_get_entry(uint32_t id, struct library_index_entry *out);
+// Copies the string at a library_index_entry offset, truncated to fit
+int library_get_string(uint32_t offset, char *buf, size_t len);
+// Absolute path of the track, ready for fs_open
+int library_get_path(uint32_t id, char *buf, size_t len);
+
+// First track in the jump bucket, or the one after it when the bucket is empty
+int library_sort_jump(enum library_sort_field field, int bucket, struct library_cursor *cursor);
+// First track whose sort key is at or after text. Returns 0 when it starts with
+// text, -ENOENT when nothing does and the cursor is where it would have been
+int library_sort_find(enum library_sort_field field, const char *text, struct library_cursor *cursor);
+// Sort blocks the last library_sort_find read from the card, cache hits don't count
+uint32_t library_sort_find_reads(void);
+// Track at the cursor, then moves it on. -ENOENT past the last track
+int library_sort_next(struct library_cursor *cursor, uint32_t *track);
+// Cursor at a position in sorted order, -ENOENT past the last track
+int library_sort_seek(enum library_sort_field field, uint32_t pos, struct library_cursor *cursor);
+// Position in sorted order of the track at the cursor, the track count past the end
+int library_sort_tell(const struct library_cursor *cursor, uint32_t *pos);
@@ -0,0 +1,73 @@
+#pragma once
+
+// Library index file generated by tools/cardprep at the root of the card.
+// All integers are little endian, string offsets point into a table of NUL
+// terminated UTF-8 strings and entries are ordered by path.
+//
+// Titles, artists and albums are also kept as sorted tables of collate.h
+// keys so the player can search them without reading every entry. A table
+// is a run of sector sized blocks, each starting with a block header and
+// followed by entries of
+//
+//   [shared u8][suffix_len u8][suffix][track id, LEB128]
+//
+// where shared is the number of leading key bytes repeated from the entry
+// before it. The first entry of a block always has shared 0, so a block
+// decodes on its own and the first key of every block can be binary
+// searched. Equal keys are ordered by track id.
+
+#include <stdint.h>
+
+#include "collate.h"
+
+#define LIBRARY_INDEX_NAME    "LIBRARY.IDX"
+#define LIBRARY_INDEX_MAGIC   "STLI"
+#define LIBRARY_INDEX_VERSION 3
+
+#define LIBRARY_SORT_BLOCK_SIZE 512
+
+enum library_sort_field {
+    LIBRARY_SORT_TITLE,
+    LIBRARY_SORT_ARTIST,
+    LIBRARY_SORT_ALBUM,
+    LIBRARY_SORT_COUNT
+};
+
+// First entry at or after the start of a jump bucket, block_count if none
+struct library_sort_jump {
+    uint32_t block;
+    uint16_t index;
+    uint16_t reserved;
+} __attribute__((packed));
+
+struct library_sort_table {
+    uint32_t blocks_offset; // Multiple of LIBRARY_SORT_BLOCK_SIZE
+    uint32_t block_count;
+    struct library_sort_jump jump[COLLATE_JUMP_COUNT];
+} __attribute__((packed));
+
+struct library_sort_block_header {
+    uint32_t first_pos; // Sorted position of the first entry
+    uint16_t count;
+    uint16_t size; // Bytes used including this header
+} __attribute__((packed));
+
+struct library_index_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t track_count;
+    uint32_t entries_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+    struct library_sort_table sort[LIBRARY_SORT_COUNT];
+} __attribute__((packed));
+
+struct library_index_entry {
+    uint32_t path; // Relative to the card root
+    uint32_t title;
+    uint32_t artist;
+    uint32_t album;
+    uint32_t duration_ms;
+    uint32_t file_size;
+} __attribute__((packed));
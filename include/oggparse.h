@@ -0,0 +1,105 @@
+#pragma once
+
+// Buffer driven Ogg/Opus container parsing. Has no Zephyr dependencies so the
+// host side card preparation tool builds from the same code as the player.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define OGG_PAGE_HEADER_SIZE 27
+#define OGG_MAX_SEGMENTS     255
+
+#define OGG_FLAG_CONTINUED 0x01
+#define OGG_FLAG_BOS       0x02
+#define OGG_FLAG_EOS       0x04
+
+#define OGG_NEED_MORE     0 // All input consumed, feed more
+#define OGG_PACKET        1 // A complete packet is in packet_buf
+#define OGG_ERR_CAPTURE  -1 // Missing OggS capture pattern
+#define OGG_ERR_VERSION  -2 // Unsupported stream structure version
+#define OGG_ERR_TOOLARGE -3 // Packet does not fit packet_buf
+
+#define OPUS_HEAD_MIN_SIZE 19
+#define OPUS_MAX_FRAME_SAMPLES 5760 // 120ms at 48kHz
+
+struct ogg_page_header {
+    uint8_t flags;
+    int64_t granule;
+    uint32_t serial;
+    uint32_t sequence;
+    uint32_t checksum;
+    uint8_t segment_count;
+};
+
+enum parser_state {
+    STATE_HEADER,
+    STATE_SEGMENT_TABLE,
+    STATE_SEGMENTS
+};
+
+struct ogg_parser {
+    uint8_t state;
+    uint8_t header[OGG_PAGE_HEADER_SIZE];
+    uint8_t seg_table[OGG_MAX_SEGMENTS];
+    size_t header_bytes;
+    size_t seg_table_bytes;
+    uint8_t nsegs;
+    uint8_t current_seg;
+    int16_t last_complete_seg;
+    uint16_t current_seg_remaining;
+    uint8_t *packet_buf;
+    size_t packet_cap;
+    size_t packet_size;
+    bool packet_ready;
+    struct ogg_page_header page;
+
+    // Valid when OGG_PACKET is returned
+    bool packet_last_on_page; // page.granule belongs to this packet
+    bool packet_eos;
+    uint32_t packet_count;
+};
+
+struct opus_head {
+    uint8_t version;
+    uint8_t channels;
+    uint16_t pre_skip;
+    uint32_t input_sample_rate;
+    int16_t output_gain;
+    uint8_t mapping_family;
+};
+
+struct opus_tags_iter {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    uint32_t remaining;
+};
+
+int ogg_page_header_parse(const uint8_t *raw, struct ogg_page_header *hdr);
+void ogg_page_header_write(uint8_t *raw, const struct ogg_page_header *hdr);
+uint32_t ogg_crc_update(uint32_t crc, const uint8_t *data, size_t len);
+
+void ogg_parser_init(struct ogg_parser *p, uint8_t *packet_buf, size_t packet_cap);
+int ogg_parser_feed(struct ogg_parser *p, const uint8_t *data, size_t len, size_t *consumed);
+
+int opus_head_parse(const uint8_t *buf, size_t len, struct opus_head *head);
+int opus_toc_samples(const uint8_t *packet, size_t len);
+
+// Walks the vendor string and user comments of an OpusTags packet
+int opus_tags_iter_init(struct opus_tags_iter *it, const uint8_t *buf, size_t len,
+                        const uint8_t **vendor, uint32_t *vendor_len);
+bool opus_tags_iter_next(struct opus_tags_iter *it, const uint8_t **comment, uint32_t *comment_len);
+// Binary data following the comment list, valid once the iterator is exhausted
+size_t opus_tags_trailer(const struct opus_tags_iter *it, const uint8_t **trailer);
+
+static inline uint32_t ogg_read_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void ogg_write_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
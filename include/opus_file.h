@@ -12,6 +12,15 @@ typedef struct {
     uint8_t page_segment_count;
     uint8_t segment_pos;
     uint8_t remaining_segments;
+    int16_t last_complete_segment;
+
+    int64_t page_granule;
+    int64_t packet_granule; // End granule of the last packet read, -1 if not known
+    uint16_t pre_skip;
+
+    off_t audio_offset;      // First audio page
+    off_t seek_table_offset; // First seek_table_entry, see card_layout.h
+    uint16_t seek_entries;
 
     _Bool is_eos_page;
 } opus_state_t;
@@ -26,12 +35,15 @@ typedef struct {
 #define OP_NOTAGS -6 // Missing opus tags
 #define OP_ZERO   -7 // zero length opus packet
 #define OP_TOOLARGE -8 // Opus packet exceedes limit
+#define OP_NOSEEK   -9 // No seek table in file
 
 #define OP_OK     1 // Success
 #define OP_DONE   2 // Done reading ogg container
 
-uint16_t opus_verify_header(struct fs_file_t* fp, opus_state_t *state);
+int opus_verify_header(struct fs_file_t* fp, opus_state_t *state);
 
 void opus_state_init(opus_state_t *st);
 
 int opus_get_packet(opus_state_t *st, uint8_t *buff, uint16_t *pack_size, struct fs_file_t *fp);
+
+int opus_seek(opus_state_t *st, struct fs_file_t *fp, int64_t granule, int64_t *page_start);
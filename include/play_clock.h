@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Playback position of what is currently audible, in samples per channel from
+// the start of the track (after pre-skip). Written by the audio thread as
+// blocks leave the I2S DMA, read lock-free from anywhere.
+
+#define PLAY_CLOCK_MAX_BLOCKS 8
+
+struct play_clock_snapshot {
+    uint64_t samples;
+    uint32_t ms;
+    bool active;
+    bool paused;
+};
+
+// Audio thread side
+void play_clock_reset(void);
+void play_clock_queue(int64_t end_position);
+void play_clock_sync(uint32_t in_flight);
+void play_clock_set_active(bool active);
+void play_clock_set_paused(bool paused);
+// A new track cuts in behind the blocks still queued, they read as its start
+void play_clock_cut(void);
+
+// Transport latency probe, see latency_probe.h. A command is marked with the
+// time it was sent, the first block queued afterwards that carries its effect
+// marks the response. The time until that block starts playing is checked
+// against LATENCY_BOUND_US.
+void play_clock_mark_command(int64_t sent_ticks);
+void play_clock_mark_response(void);
+uint32_t play_clock_worst_latency_us(void);
+
+void play_clock_get(struct play_clock_snapshot *out);
@@ -0,0 +1,38 @@
+#pragma once
+
+// Play order over the whole library. Shuffle is a seeded Feistel permutation
+// of the track ids with cycle walking, so any library size shuffles in
+// constant memory and every track plays once before the order repeats.
+// Plain C with no Zephyr dependencies.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PLAY_QUEUE_ROUNDS 4
+
+struct play_queue {
+    uint32_t count; // Tracks in the library
+    uint32_t pos;   // Position in the current cycle of the play order
+    uint32_t start; // Permutation slot the cycle started at
+    bool shuffle;
+    uint32_t seed;
+
+    // Permutation domain is 2^(2 * half_bits) >= count
+    uint8_t half_bits;
+    uint32_t keys[PLAY_QUEUE_ROUNDS];
+};
+
+void play_queue_init(struct play_queue *q, uint32_t count);
+// Switching keeps the current track current, the order around it changes
+void play_queue_set_shuffle(struct play_queue *q, bool shuffle, uint32_t seed);
+
+uint32_t play_queue_current(const struct play_queue *q);
+// Makes a track current, next and prev continue from its place in the order
+void play_queue_jump(struct play_queue *q, uint32_t id);
+
+// Wraps once every track played, a shuffled queue reseeds for a fresh order
+bool play_queue_next(struct play_queue *q, uint32_t *id);
+// False at the start of the order
+bool play_queue_prev(struct play_queue *q, uint32_t *id);
+// Track offset places ahead of the current one without moving, for prefetching
+bool play_queue_peek(const struct play_queue *q, uint32_t offset, uint32_t *id);
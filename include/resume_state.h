@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "play_queue.h"
+
+#define RESUME_STATE_PATH "/SD:/RESUME.DAT"
+#define RESUME_STATE_MAGIC 0x53525453 // "STRS"
+#define RESUME_SAVE_INTERVAL_MS 10000
+
+struct resume_state {
+    uint32_t magic;
+    struct play_queue queue; // Current track and the shuffle order around it
+    uint32_t position_ms;
+    uint32_t checksum;
+};
+
+int resume_state_load(struct resume_state *out);
+// Queues a write on the system workqueue so the caller never touches the card
+void resume_state_save(const struct play_queue *queue, uint32_t position_ms);
@@ -0,0 +1,30 @@
+#pragma once
+
+// LVGL font whose glyphs are streamed from a font file on the card (see
+// font_file.h) into a fixed size LRU cache. Rendering never reads the card,
+// a glyph that isn't cached yet is drawn blank and loaded in the background,
+// the screen is redrawn once it arrives. Codepoints the file doesn't have
+// fall through to the fallback font.
+
+#include <stdint.h>
+#include <lvgl.h>
+
+#include "font_file.h"
+
+#define SD_FONT_PATH "/SD:/" FONT_FILE_NAME
+
+// Roughly 12 KiB with 16x16 glyphs, a full screen of CJK text is ~100 glyphs
+#define SD_FONT_CACHE_GLYPHS 256
+#define SD_FONT_HASH_BUCKETS 512
+// Page table capacity, 16384 glyphs covers JIS X 0208 and then some
+#define SD_FONT_MAX_PAGES 512
+#define SD_FONT_QUEUE_LEN 64
+
+// Returns NULL if the card has no usable font file
+const lv_font_t *sd_font_open(const lv_font_t *fallback);
+// Queues every glyph of a UTF-8 string that isn't cached yet
+void sd_font_prefetch(const char *text);
+// Called from the LVGL thread before every lv_timer_handler, starts a new frame
+// and invalidates the screen when glyphs drawn blank have loaded. Glyphs laid
+// out in a frame are pinned in the cache until the next call.
+void sd_font_poll(void);
@@ -1,12 +1,23 @@
 #pragma once
 
 #include <stdint.h>
+#include <zephyr/kernel.h>
 #include <zephyr/fs/fs.h>
 #include <ff.h>
 #include <lvgl.h>
 
+#include "library.h"
+
 bool is_mounted(void);
 
 void setup_disk(void);
+void setup_disk_async(void);
+int wait_for_disk(k_timeout_t timeout);
 int populate_list_with_files(lv_obj_t *list);
+// Replaces the rows with a window of tracks from the cursor on
+int populate_list_from(lv_obj_t *list, struct library_cursor *cursor);
+// Highlights the row at a position in the sorted table the list shows and
+// scrolls to it, refilling the window around it first when it is outside.
+// Gives the track on that row.
+int select_list_position(lv_obj_t *list, uint32_t pos, uint32_t *track);
 
@@ -0,0 +1,59 @@
+#pragma once
+
+// The audio thread's block loop: when it waits for the DMA, when it reads
+// commands and whether the next block is audio or pause silence. Plain C with
+// no Zephyr dependencies, the audio thread supplies the DMA, the command pipe
+// and the decoder as callbacks and tools/latsim runs the same loop in virtual
+// time against the transport latency probe.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum transport_fade {TRANSPORT_FADE_NONE, TRANSPORT_FADE_IN, TRANSPORT_FADE_OUT};
+
+enum transport_resume {
+    TRANSPORT_RESUME_IGNORED,   // Nothing was paused
+    TRANSPORT_RESUME_WITHDRAWN, // Paused before the fade out went out, just carries on
+    TRANSPORT_RESUME_FADE_IN,   // The next block fades back in
+};
+
+struct transport {
+    bool playing; // A track is open and its blocks go to the DMA
+    bool paused;  // Faded out, silence goes out until resumed
+    enum transport_fade pending_fade; // Applied to the next audio block
+};
+
+struct transport_ops {
+    // Blocks until the DMA has a slot free and returns it, NULL if playback had to stop
+    void *(*slot_acquire)(void *ctx);
+    // Gives back a slot that won't be queued
+    void (*slot_release)(void *ctx, void *slot);
+    // Reads and handles the next command. With wait set it sleeps until one
+    // arrives, otherwise it returns false once none are queued.
+    bool (*command)(void *ctx, bool wait);
+    // Queues slot as a pause block. Negative if playback had to stop.
+    int (*silence)(void *ctx, void *slot);
+    // Decodes the next packet into slot and queues it with fade applied. 1 if
+    // it was queued, 0 if nothing audible came out and slot was given back,
+    // negative if playback had to stop. end is set on the last packet.
+    int (*audio)(void *ctx, void *slot, enum transport_fade fade, bool *end);
+    // After an audio packet, with end set when it was the track's last
+    void (*packet_done)(void *ctx, bool end);
+};
+
+void transport_init(struct transport *t);
+// A track started. A skip over a playing track fades in and clears a pause,
+// one following on without a skip keeps it.
+void transport_start(struct transport *t, bool skip);
+void transport_stop(struct transport *t);
+// Paused or fading out to pause
+bool transport_pausing(const struct transport *t);
+// Returns true if the pause takes effect with the next block
+bool transport_pause(struct transport *t);
+enum transport_resume transport_resume(struct transport *t);
+
+// One pass of the loop. Playing, it waits for a DMA slot and only then reads
+// every queued command, so the block produced right after them is the next
+// one queued and a command never waits out a block decoded while it sat in
+// the pipe. Stopped, it sleeps until a command arrives.
+void transport_step(struct transport *t, const struct transport_ops *ops, void *ctx);
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <lvgl.h>
+
+#define VIS_BARS 16
+#define VIS_BAR_MAX 31
+
+// Decimation applied to the 48kHz stream before the FFT, bars cover 0..6kHz
+#define VIS_DECIMATION 4
+#define VIS_FFT_SIZE_MAX 256
+#define VIS_FFT_SIZE_MIN 64
+#define VIS_RING_SLOTS 4
+
+#define VIS_THREAD_PRIO 10
+
+// Detail levels, stepped down as decode load rises
+enum vis_level {
+    VIS_LEVEL_FULL,    // 256 point FFT on every block
+    VIS_LEVEL_REDUCED, // 64 point FFT on every other block
+    VIS_LEVEL_VU_ONLY, // No FFT, only peak meters
+};
+
+struct vis_frame {
+    uint8_t bars[VIS_BARS];
+    uint8_t vu_left;
+    uint8_t vu_right;
+    uint8_t level;
+};
+
+struct vis_stats {
+    uint32_t frames;
+    uint32_t dropped;
+    uint32_t max_us;
+    uint32_t avg_us;
+    uint8_t level;
+};
+
+// Called from the audio thread for every decoded block, never blocks
+void visualizer_submit(const int16_t *pcm, int frames, uint32_t decode_us);
+
+// Copies out the latest analysed frame, returns false if nothing new since last_seq
+bool visualizer_get_frame(struct vis_frame *out, uint32_t *last_seq);
+
+void visualizer_get_stats(struct vis_stats *out);
+
+void visualizer_ui_create(lv_obj_t *parent);
+void visualizer_ui_update(void);
@@ -11,8 +11,19 @@
 #include <zephyr/drivers/i2s.h>
 #include <zephyr/audio/codec.h>
 #include <zephyr/fs/fs.h>
+#include <zephyr/sys/atomic.h>
 
 #include "opus_file.h"
+#include "visualizer.h"
+#include "play_clock.h"
+#include "clock_governor.h"
+#include "resume_state.h"
+#include "library.h"
+#include "play_queue.h"
+#include "crossfade.h"
+#include "boot_prof.h"
+#include "sd_storage.h"
+#include "transport.h"
 
 LOG_MODULE_REGISTER(audio_playback, LOG_LEVEL_DBG);
 
@@ -23,6 +34,37 @@ static opus_state_t op_state;
 static struct fs_file_t filep;
 OpusDecoder *decoder;
 
+// Track position of the next sample out of the decoder, negative during pre-skip
+static int64_t decode_position;
+
+// Samples decoded and dropped before a seek target, as recommended by RFC 7845
+#define SEEK_PREROLL 3840
+
+// Silence written while paused keeps the SAI clocked. Short blocks mean a
+// resume only queues behind 10 ms of it.
+#define PAUSE_BLOCK_SAMPLES 480
+// Ramp applied when audio restarts mid waveform, after a resume or a skip
+#define FADE_IN_SAMPLES 480
+
+static struct play_queue queue;
+static uint32_t last_saved_ms;
+static bool track_open;
+
+// Crossfade length, 0 plays tracks back to back
+static uint32_t crossfade_samples;
+// Length of the current track from the library index, 0 if not known
+static int64_t track_length;
+
+// Path of the track after the current one, looked up while this one plays
+static uint32_t prefetched_id = UINT32_MAX;
+static char prefetched_path[LIBRARY_PATH_MAX];
+static bool dma_running;
+static atomic_t now_playing = ATOMIC_INIT(UINT32_MAX);
+static atomic_t shuffled;
+static struct transport transport;
+// When the command being handled was sent
+static int64_t command_ticks;
+
 K_MEM_SLAB_DEFINE_STATIC(tx_0_mem_slab, WB_UP(BLOCK_SIZE), NUM_BLOCKS, 32);
 
 static int start_i2s_dma() {
@@ -41,8 +83,10 @@ static int start_i2s_dma() {
         ret = i2s_write(i2s_dev, init_block, BLOCK_SIZE);
         if (ret < 0) {
             LOG_ERR("i2s_write initial block failed: %d", ret);
-            k_mem_slab_free(&tx_0_mem_slab, &init_block);
+            k_mem_slab_free(&tx_0_mem_slab, init_block);
+            continue;
         }
+        play_clock_queue(0);
     }
 
     LOG_INF("Starting i2s DMAs");
@@ -51,11 +95,15 @@ static int start_i2s_dma() {
         LOG_ERR("I2S trigger start failed: %d", ret);
         return -1;
     }
+    dma_running = true;
     return 0;
 }
 
 static int stop_i2s_dma() {
     LOG_INF("Stopping i2s DMAs");
+    dma_running = false;
+    atomic_set(&now_playing, UINT32_MAX);
+    crossfade_cancel();
     int ret = i2s_trigger(i2s_dev, I2S_DIR_TX, I2S_TRIGGER_DRAIN);
     if (ret < 0) {
         LOG_ERR("Failed to stop i2s with drain: %d", ret);
@@ -64,127 +112,454 @@ static int stop_i2s_dma() {
     return 0;
 }
 
-void play_opus_packet(bool *isPlaying, int discard_cnt, uint16_t volume) {
-    void * block = NULL;
-    uint16_t packet_size;
-    int rcf = opus_get_packet(&op_state, opus_packet, &packet_size, &filep);
-    if (rcf != OP_OK && rcf != OP_DONE) {
+static void close_track(void) {
+    if (track_open) {
         fs_close(&filep);
-        opus_decoder_ctl(decoder, OPUS_RESET_STATE);
+        track_open = false;
+    }
+    opus_decoder_ctl(decoder, OPUS_RESET_STATE);
+}
+
+static void stop_playback(void) {
+    close_track();
+    if (dma_running) {
         stop_i2s_dma();
-        *isPlaying = false;
-        return;
     }
+    play_clock_set_active(false);
+    transport_stop(&transport);
+}
 
-    int rc = k_mem_slab_alloc(&tx_0_mem_slab, &block, K_FOREVER);
-    if (rc < 0) {
-        LOG_ERR("Block allocation failed: %d", rc);
-        *isPlaying = false;
-        return;
+static void apply_fade(int16_t *pcm, int fade_frames, enum transport_fade fade) {
+    for (int i = 0; i < fade_frames; i++) {
+        int32_t gain = (fade == TRANSPORT_FADE_IN ? i : fade_frames - i) * 32768 / fade_frames;
+        pcm[i * CHANNELS] = (pcm[i * CHANNELS] * gain) >> 15;
+        pcm[i * CHANNELS + 1] = (pcm[i * CHANNELS + 1] * gain) >> 15;
+    }
+}
+
+// Decodes the next packet into block and queues it, see transport_ops.audio
+static int play_opus_packet(void *block, enum transport_fade fade, uint32_t *discard_cnt, bool *end) {
+    uint16_t packet_size;
+    timing_t read_start = timing_counter_get();
+    int rcf = opus_get_packet(&op_state, opus_packet, &packet_size, &filep);
+    uint32_t read_us = clock_governor_work_us(read_start, timing_counter_get());
+    if (rcf != OP_OK && rcf != OP_DONE) {
+        k_mem_slab_free(&tx_0_mem_slab, block);
+        stop_playback();
+        return rcf;
     }
+    *end = rcf == OP_DONE;
+
+    timing_t decode_start = timing_counter_get();
     int oprc = opus_decode(decoder, opus_packet, packet_size, block, SAMPLE_NO, 0);
+    uint32_t decode_us = clock_governor_work_us(decode_start, timing_counter_get());
+    if (oprc < 0) {
+        LOG_ERR("Opus decode failed: %d", oprc);
+        oprc = 0;
+    }
 
-    if (discard_cnt > 0) {
-        size_t discard_samples = discard_cnt * 2;
+    // Page granules re-anchor the position so it can't drift
+    if (op_state.packet_granule >= 0) {
+        decode_position = op_state.packet_granule - op_state.pre_skip;
+    } else {
+        decode_position += oprc;
+    }
 
-        if (discard_samples > (size_t)oprc) {
-            LOG_ERR("Discard too large");
-        }
+    if (*discard_cnt > 0 && oprc > 0) {
+        int discard = MIN(*discard_cnt, (uint32_t) oprc);
 
         int16_t *audio_data = (int16_t *)block;
         memmove(audio_data, 
-                audio_data + discard_samples,  // skip discards
-                (oprc - discard_samples) * sizeof(int16_t));
+                audio_data + discard * CHANNELS,  // skip discards
+                (oprc - discard) * CHANNELS * sizeof(int16_t));
 
-        oprc -= discard_samples;
+        oprc -= discard;
+        *discard_cnt -= discard;
     }
 
-    rc = i2s_write(i2s_dev, block, BLOCK_SIZE);
+    // Nothing audible left, a packet wholly inside the seek pre-roll or one
+    // that failed to decode. The DMA carries on with what's already queued.
+    if (oprc == 0) {
+        k_mem_slab_free(&tx_0_mem_slab, block);
+        if (*end) {
+            close_track();
+        }
+        return 0;
+    }
+
+    uint32_t fade_us = crossfade_apply(block, oprc, read_us + decode_us);
+
+    // After the crossfade mix, a pause mid fade takes the outgoing track down
+    // with the incoming one
+    if (fade == TRANSPORT_FADE_OUT) {
+        apply_fade(block, oprc, TRANSPORT_FADE_OUT);
+    } else if (fade == TRANSPORT_FADE_IN) {
+        apply_fade(block, MIN(oprc, FADE_IN_SAMPLES), TRANSPORT_FADE_IN);
+    }
+
+    visualizer_submit(block, oprc, decode_us);
+
+    // Blocks still queued ahead of this one, 0 means the DMA already ran dry
+    uint32_t in_flight = k_mem_slab_num_used_get(&tx_0_mem_slab) - 1;
+    // Only the decoded frames go out, a short block mustn't play a stale tail
+    int rc = i2s_write(i2s_dev, block, oprc * CHANNELS * sizeof(int16_t));
     if (rc < 0) {
         LOG_ERR("i2s_write failed: %d", rc);
-        k_mem_slab_free(&tx_0_mem_slab, &block);
-        *isPlaying = false;
-        return;
+        k_mem_slab_free(&tx_0_mem_slab, block);
+        stop_playback();
+        return rc;
     }
+    play_clock_queue(decode_position);
+    play_clock_mark_response();
+    boot_mark(BOOT_FIRST_AUDIO);
 
-    // Done with file
-    if (rcf == OP_DONE) {
+    if (fade == TRANSPORT_FADE_OUT) {
+        resume_state_save(&queue, MAX(decode_position, 0) * 1000 / SAMPLE_RATE);
+    }
+    clock_governor_block(read_us + decode_us + fade_us, oprc, in_flight);
+
+    // Done with file, the DMA keeps running for the next track in the queue
+    if (*end) {
         LOG_INF("Done with file");
-        fs_close(&filep);
-        opus_decoder_ctl(decoder, OPUS_RESET_STATE);
-        stop_i2s_dma();
-        *isPlaying = false;
+        close_track();
+    }
+    return 1;
+}
+
+static int play_pause_block(void *block) {
+    memset(block, 0, PAUSE_BLOCK_SAMPLES * CHANNELS * sizeof(int16_t));
+    int rc = i2s_write(i2s_dev, block, PAUSE_BLOCK_SAMPLES * CHANNELS * sizeof(int16_t));
+    if (rc < 0) {
+        LOG_ERR("i2s_write failed: %d", rc);
+        k_mem_slab_free(&tx_0_mem_slab, block);
+        stop_playback();
+        return rc;
+    }
+    play_clock_queue(decode_position);
+    return 0;
+}
+
+static void prefetch_next(void) {
+    uint32_t id;
+    if (!play_queue_peek(&queue, 1, &id) || id == prefetched_id) return;
+
+    if (library_get_path(id, prefetched_path, sizeof(prefetched_path)) < 0) {
+        prefetched_id = UINT32_MAX;
+        return;
+    }
+    prefetched_id = id;
+}
+
+// A skip is a user command, it's faded in and its latency measured. Without
+// one the new track follows on gaplessly, paused if the last one was.
+static int start_track(uint32_t id, uint32_t *discard_cnt, bool skip) {
+    // Set up a new opus file to be played
+    int rc;
+    bool cut_over = dma_running;
+    char path[LIBRARY_PATH_MAX];
+
+    if (id == prefetched_id) {
+        strcpy(path, prefetched_path);
+    } else if ((rc = library_get_path(id, path, sizeof(path))) < 0) {
+        LOG_ERR("No path for track %u: %d", id, rc);
+        return rc;
+    }
+
+    if (cut_over) {
+        // The new track queues up behind the blocks already in the DMA
+        if (skip) {
+            play_clock_mark_command(command_ticks);
+            crossfade_cancel();
+        }
+        close_track();
+    }
+    fs_file_t_init(&filep);
+
+    if ((rc = fs_open(&filep, path, FS_O_READ)) < 0) {
+        LOG_ERR("fs_open failed: %d", rc); 
+        stop_playback();
+        return rc;
+    }
+    track_open = true;
+
+    clock_governor_reset();
+    if (cut_over) {
+        play_clock_cut();
+    } else {
+        play_clock_reset();
+        rc = start_i2s_dma();
+        if (rc < 0) {
+            stop_playback();
+            return rc;
+        }
+    }
+
+    opus_state_init(&op_state);
+
+    rc = opus_verify_header(&filep, &op_state); 
+    if (rc < 0) {
+        stop_playback();
+        return rc;
+    }
+
+    *discard_cnt = op_state.pre_skip;
+    decode_position = -op_state.pre_skip;
+    transport_start(&transport, skip);
+    play_clock_set_paused(transport_pausing(&transport));
+    play_clock_set_active(true);
+
+    struct library_index_entry entry;
+    track_length = library_get_entry(id, &entry) == 0 ? (int64_t) entry.duration_ms * SAMPLE_RATE / 1000 : 0;
+
+    LOG_INF("Playing track %u: %s", id, path);
+    atomic_set(&now_playing, id);
+    last_saved_ms = 0;
+    resume_state_save(&queue, 0);
+    prefetch_next();
+    return 0;
+}
+
+// On failure the track carries on from where it was, and so does its position
+static int seek_track(uint32_t position_ms, uint32_t *discard_cnt) {
+    int64_t target = op_state.pre_skip + (int64_t) position_ms * SAMPLE_RATE / 1000;
+    int64_t seek_to = MAX(target - SEEK_PREROLL, 0);
+    int64_t page_start;
+    int rc = opus_seek(&op_state, &filep, seek_to, &page_start);
+    if (rc < 0) {
+        LOG_WRN("Seek to %u ms failed: %d", position_ms, rc);
+        return rc;
+    }
+    crossfade_cancel();
+
+    opus_decoder_ctl(decoder, OPUS_RESET_STATE);
+    *discard_cnt = target - page_start;
+    decode_position = page_start - op_state.pre_skip;
+    return 0;
+}
+
+// Starts whatever was playing at power off, or the first track in the library
+static void resume_last_track(uint32_t *discard_cnt) {
+    struct resume_state resume;
+    uint32_t position_ms = 0;
+
+    library_open();
+    play_queue_init(&queue, library_count());
+
+    // The saved order only holds while the library is the same size
+    if (resume_state_load(&resume) == 0 && resume.queue.count == queue.count) {
+        queue = resume.queue;
+        position_ms = resume.position_ms;
+    }
+    atomic_set(&shuffled, queue.shuffle);
+    boot_mark(BOOT_RESUME_LOADED);
+
+    if (queue.count == 0 || start_track(play_queue_current(&queue), discard_cnt, false) < 0) {
+        return;
+    }
+    // The track was just opened, a failed seek leaves it at the start and the
+    // saved position has to say so too
+    if (position_ms > 0 && seek_track(position_ms, discard_cnt) < 0) {
+        LOG_WRN("Resuming track %u from the start", play_queue_current(&queue));
+        resume_state_save(&queue, 0);
+    }
+}
+
+// Hands the current track to the crossfade once it is within the fade length
+// of its end and starts the next one underneath it
+static void start_crossfade(uint32_t *discard_cnt) {
+    if (crossfade_samples == 0 || track_length == 0 || transport.paused || transport.pending_fade != TRANSPORT_FADE_NONE || crossfade_active()) {
+        return;
+    }
+
+    int64_t remaining = track_length - decode_position;
+    uint32_t id;
+    if (remaining > crossfade_samples || !play_queue_peek(&queue, 1, &id)) {
         return;
     }
+
+    if (crossfade_begin(&filep, &op_state, decoder, *discard_cnt, MAX(remaining, 0)) < 0) {
+        return;
+    }
+    track_open = false;
+
+    play_queue_next(&queue, &id);
+    if (start_track(id, discard_cnt, false) < 0) {
+        stop_playback();
+    }
+}
+
+// Persists the position every RESUME_SAVE_INTERVAL_MS of playback
+static void save_position(void) {
+    struct play_clock_snapshot position;
+    play_clock_get(&position);
+
+    if (position.ms >= last_saved_ms && position.ms - last_saved_ms < RESUME_SAVE_INTERVAL_MS) {
+        return;
+    }
+    last_saved_ms = position.ms;
+    resume_state_save(&queue, position.ms);
+}
+
+uint32_t audio_now_playing(void) {
+    return (uint32_t) atomic_get(&now_playing);
+}
+
+bool audio_shuffled(void) {
+    return atomic_get(&shuffled) != 0;
+}
+
+static void handle_message(const audio_thread_msg *msg, uint32_t *discard_cnt, uint16_t *volume) {
+    uint32_t track_id;
+    command_ticks = msg->sent_ticks;
+
+    switch(msg->msg_type) {
+        case PLAY:
+            play_queue_jump(&queue, msg->track_id);
+            start_track(play_queue_current(&queue), discard_cnt, true);
+        break;
+        case NEXT:
+            if (play_queue_next(&queue, &track_id)) {
+                start_track(track_id, discard_cnt, true);
+            }
+        break;
+        case PREV:
+            if (!play_queue_prev(&queue, &track_id)) {
+                track_id = play_queue_current(&queue);
+            }
+            start_track(track_id, discard_cnt, true);
+        break;
+        case SHUFFLE:
+            play_queue_set_shuffle(&queue, msg->shuffle, k_cycle_get_32() ^ (uint32_t) k_uptime_ticks());
+            atomic_set(&shuffled, queue.shuffle);
+            prefetch_next();
+            resume_state_save(&queue, last_saved_ms);
+        break;
+        case PAUSE:
+            if (transport_pause(&transport)) {
+                play_clock_mark_command(command_ticks);
+                play_clock_set_paused(true);
+            }
+        break;
+        case RESUME:
+            switch (transport_resume(&transport)) {
+                case TRANSPORT_RESUME_FADE_IN:
+                    play_clock_mark_command(command_ticks);
+                    play_clock_set_paused(false);
+                break;
+                case TRANSPORT_RESUME_WITHDRAWN:
+                    play_clock_set_paused(false);
+                break;
+                case TRANSPORT_RESUME_IGNORED:
+                break;
+            }
+        break;
+        case SEEK:
+            if (transport.playing) {
+                seek_track(msg->position_ms, discard_cnt);
+            }
+        break;
+        case CROSSFADE:
+            crossfade_samples = (uint64_t) MIN(msg->duration_ms, CROSSFADE_MAX_MS) * SAMPLE_RATE / 1000;
+        break;
+        case VOL:
+            *volume = msg->volume; 
+        break;
+        default:
+            LOG_INF("Got message type %d", msg->msg_type);
+        break;
+    }
 }
 
+// State the transport callbacks need, owned by the audio thread
+struct audio_loop {
+    struct k_pipe *pipe;
+    uint32_t discard_cnt;
+    uint16_t volume;
+};
+
+static void *loop_slot_acquire(void *ctx) {
+    void *slot;
+    int rc = k_mem_slab_alloc(&tx_0_mem_slab, &slot, K_FOREVER);
+    if (rc < 0) {
+        LOG_ERR("Block allocation failed: %d", rc);
+        stop_playback();
+        return NULL;
+    }
+    // Whatever the DMA released to make room for this slot has been played
+    play_clock_sync(k_mem_slab_num_used_get(&tx_0_mem_slab) - 1);
+    return slot;
+}
+
+static void loop_slot_release(void *ctx, void *slot) {
+    k_mem_slab_free(&tx_0_mem_slab, slot);
+}
+
+static bool loop_command(void *ctx, bool wait) {
+    struct audio_loop *loop = ctx;
+    audio_thread_msg receivedMessage;
+    receivedMessage.msg_type = DEF;
+    int ret = k_pipe_read(loop->pipe, (uint8_t *) &receivedMessage, sizeof(audio_thread_msg), wait ? K_FOREVER : K_NSEC(1));
+    if (ret < 0 && ret != -EAGAIN) {
+        LOG_ERR("Read pipe error %d", ret);
+    }
+    if (receivedMessage.msg_type == DEF) return false;
+
+    handle_message(&receivedMessage, &loop->discard_cnt, &loop->volume);
+    return true;
+}
+
+static int loop_silence(void *ctx, void *slot) {
+    return play_pause_block(slot);
+}
+
+static int loop_audio(void *ctx, void *slot, enum transport_fade fade, bool *end) {
+    struct audio_loop *loop = ctx;
+    return play_opus_packet(slot, fade, &loop->discard_cnt, end);
+}
+
+static void loop_packet_done(void *ctx, bool end) {
+    struct audio_loop *loop = ctx;
+    uint32_t track_id;
+
+    if (!end) {
+        save_position();
+        start_crossfade(&loop->discard_cnt);
+        return;
+    }
+
+    // Track finished cleanly, the next one follows without a gap
+    if (!play_queue_next(&queue, &track_id) || start_track(track_id, &loop->discard_cnt, false) < 0) {
+        stop_playback();
+    }
+}
+
+static const struct transport_ops loop_ops = {
+    .slot_acquire = loop_slot_acquire,
+    .slot_release = loop_slot_release,
+    .command = loop_command,
+    .silence = loop_silence,
+    .audio = loop_audio,
+    .packet_done = loop_packet_done,
+};
+
 void audio_handler_thread(void *pipeP, void *arg2, void *arg3) {
     LOG_INF("Started audio");
-    struct k_pipe* pipe = (struct k_pipe*) pipeP;
+    struct audio_loop loop = {.pipe = (struct k_pipe*) pipeP};
     int ret = init_audio_playback();
     if (ret < 0) {
         LOG_INF("Failed audio Init");
         return;
     }
+    boot_mark(BOOT_AUDIO_READY);
+    transport_init(&transport);
 
-    bool isPlaying = false;
-    
-    uint16_t discard_cnt = 0;
-    uint16_t volume = 0;
-    while(1) {
-        audio_thread_msg receivedMessage;
-        receivedMessage.msg_type = DEF;
-        int ret = k_pipe_read(pipe, (uint8_t *) &receivedMessage, sizeof(audio_thread_msg), K_NSEC(1));
-        if (ret < 0 && ret != -EAGAIN) {
-            LOG_ERR("Read pipe error %d", ret);
-        }
-
-        switch(receivedMessage.msg_type) {
-            case PLAY:
-                // Set up a new opus file to be played
-                int rc;
-                isPlaying = true;
-                fs_file_t_init(&filep);
-
-                if ((rc = fs_open(&filep, receivedMessage.song_path, FS_O_READ)) < 0) {
-                    LOG_ERR("fs_open failed: %d", rc); 
-                    continue;
-                }
-
-                rc = start_i2s_dma();
-                if (rc < 0) {
-                    fs_close(&filep);
-                    opus_decoder_ctl(decoder, OPUS_RESET_STATE);
-                    stop_i2s_dma();
-                    continue;
-                }
-
-                opus_state_init(&op_state);
-
-                discard_cnt = opus_verify_header(&filep, &op_state); 
-                if (discard_cnt < 0) {
-                    fs_close(&filep);
-                    stop_i2s_dma();
-                }
-
-                discard_cnt *= 2; 
-            break;
-            case VOL:
-                volume = receivedMessage.volume; 
-            break;
-            case DEF:
-            break;
-            default:
-                LOG_INF("Got message type %d", receivedMessage.msg_type);
-            break;
-        }
-
-        if (isPlaying) {
-            play_opus_packet(&isPlaying, discard_cnt, volume);
-            // Discard count should be 0 after first packet
-            if (discard_cnt > 0) discard_cnt = 0;
-        }
+    // Audio starts as soon as the card is mounted, the library UI loads meanwhile
+    if (wait_for_disk(K_SECONDS(5)) == 0) {
+        resume_last_track(&loop.discard_cnt);
+    }
 
+    while(1) {
+        transport_step(&transport, &loop_ops, &loop);
     }
 }
 static const struct device *codec;
@@ -271,5 +646,7 @@ int init_audio_playback() {
     }
 
     codec_initialize();
+    clock_governor_init();
+    crossfade_init();
     return 0;
 }
@@ -0,0 +1,35 @@
+#include "boot_prof.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(boot_prof, LOG_LEVEL_DBG);
+
+static const char *const phase_names[BOOT_PHASE_COUNT] = {
+    [BOOT_MAIN] = "main",
+    [BOOT_AUDIO_READY] = "audio ready",
+    [BOOT_DISPLAY_READY] = "display ready",
+    [BOOT_DISK_READY] = "disk ready",
+    [BOOT_RESUME_LOADED] = "resume loaded",
+    [BOOT_FIRST_AUDIO] = "first audio",
+    [BOOT_LIBRARY_READY] = "library ready",
+};
+
+static uint32_t phase_us[BOOT_PHASE_COUNT];
+static atomic_t seen;
+
+void boot_mark(enum boot_phase phase) {
+    if (atomic_test_bit(&seen, phase)) return;
+
+    phase_us[phase] = (uint32_t) k_ticks_to_us_floor64(k_uptime_ticks());
+
+    // Only the thread completing the set logs it
+    atomic_val_t prev = atomic_or(&seen, BIT(phase));
+    if ((prev | BIT(phase)) != BIT_MASK(BOOT_PHASE_COUNT) || prev == BIT_MASK(BOOT_PHASE_COUNT)) return;
+
+    LOG_INF("Boot profile:");
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        LOG_INF("  %-14s %6u.%03u ms", phase_names[i], phase_us[i] / 1000, phase_us[i] % 1000);
+    }
+}
@@ -0,0 +1,73 @@
+#include "clock_governor.h"
+#include "governor_policy.h"
+#include "audio_playback.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <stm32_ll_rcc.h>
+
+LOG_MODULE_REGISTER(clock_governor, LOG_LEVEL_DBG);
+
+// The governor only moves the AHB prescaler, which clocks the core, bus
+// matrix and DMA. Everything that keeps time is clocked from ahead of it
+// (see app.overlay): SAI from PLL2, SPI1 from SYSCLK, the console UART, I2C2
+// and the ADC from HSI16 and the kernel timer from LPTIM1 on the LSI. The
+// stm32 clock_control driver has no runtime HCLK API, but with those domain
+// clocks no driver depends on the rate it reported at init.
+static const uint32_t ahb_prescalers[GOV_LEVEL_COUNT] = {
+    LL_RCC_SYSCLK_DIV_1,
+    LL_RCC_SYSCLK_DIV_2,
+    LL_RCC_SYSCLK_DIV_4,
+};
+
+static struct gov_state gov;
+static uint8_t current_level;
+
+static void apply_level(uint8_t level) {
+    if (level == current_level) return;
+
+    LL_RCC_SetAHBPrescaler(ahb_prescalers[level]);
+
+    LOG_DBG("Clock level %d -> %d (HCLK /%u)", current_level, level, gov_dividers[level]);
+    current_level = level;
+}
+
+int clock_governor_init(void) {
+    struct gov_config cfg = GOV_CONFIG_DEFAULT;
+    gov_init(&gov, &cfg);
+    current_level = 0;
+    timing_init();
+    timing_start();
+    return 0;
+}
+
+void clock_governor_reset(void) {
+    apply_level(0);
+    gov.level = 0;
+    gov.calm_blocks = 0;
+    gov.peak_load = 0;
+}
+
+// timing_cycles_to_ns() converts at the full speed rate, the governor only
+// moves the AHB prescaler and leaves SystemCoreClock alone
+uint32_t clock_governor_work_us(timing_t start, timing_t end) {
+    uint64_t cycles = timing_cycles_get(&start, &end);
+    return (uint32_t)(timing_cycles_to_ns(cycles) / 1000) * gov_dividers[current_level];
+}
+
+void clock_governor_block(uint32_t work_us, uint32_t frames, uint32_t in_flight) {
+    uint32_t block_us = FRAMES_TO_US(frames);
+    uint8_t level = gov_update(&gov, work_us, block_us, in_flight);
+
+#if GOVERNOR_TRACE
+    printk("gov,%u,%u,%u,%u\n", work_us, block_us, in_flight, current_level);
+#endif
+
+    apply_level(level);
+
+    if ((gov.blocks % GOVERNOR_REPORT_BLOCKS) == 0) {
+        LOG_INF("Governor: %u blocks, %u misses, residency %u/%u/%u",
+                gov.blocks, gov.misses,
+                gov.level_blocks[0], gov.level_blocks[1], gov.level_blocks[2]);
+    }
+}
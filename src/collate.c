@@ -0,0 +1,168 @@
+#include "collate.h"
+
+#include <stdbool.h>
+
+// Bucket start codepoints, in key order
+static const uint32_t jump_start[COLLATE_JUMP_COUNT] = {
+    0x00,
+    'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm',
+    'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z',
+    0x7B,
+    0x3041, 0x304B, 0x3055, 0x305F, 0x306A, 0x306F, 0x307E, 0x3083, 0x3089, 0x308E,
+    0x3097,
+};
+
+const char *const collate_jump_labels[COLLATE_JUMP_COUNT] = {
+    "#",
+    "A", "B", "C", "D", "E", "F", "G", "H", "I", "J", "K", "L", "M",
+    "N", "O", "P", "Q", "R", "S", "T", "U", "V", "W", "X", "Y", "Z",
+    "Ω",
+    "あ", "か", "さ", "た", "な", "は", "ま", "や", "ら", "わ",
+    "漢",
+};
+
+// Latin-1 letters U+00C0-U+00FF folded to their base letter, 0 keeps the codepoint
+static const char latin1_fold[64] =
+    "aaaaaaaceeeeiiii" "dnooooo\0ouuuuyts"
+    "aaaaaaaceeeeiiii" "dnooooo\0ouuuuyty";
+
+// Half width katakana U+FF66-U+FF9D as full width katakana
+static const uint16_t halfwidth_kana[56] = {
+    0x30F2, 0x30A1, 0x30A3, 0x30A5, 0x30A7, 0x30A9, 0x30E3, 0x30E5, 0x30E7, 0x30C3,
+    0x30FC, 0x30A2, 0x30A4, 0x30A6, 0x30A8, 0x30AA, 0x30AB, 0x30AD, 0x30AF, 0x30B1,
+    0x30B3, 0x30B5, 0x30B7, 0x30B9, 0x30BB, 0x30BD, 0x30BF, 0x30C1, 0x30C4, 0x30C6,
+    0x30C8, 0x30CA, 0x30CB, 0x30CC, 0x30CD, 0x30CE, 0x30CF, 0x30D2, 0x30D5, 0x30D8,
+    0x30DB, 0x30DE, 0x30DF, 0x30E0, 0x30E1, 0x30E2, 0x30E4, 0x30E6, 0x30E8, 0x30E9,
+    0x30EA, 0x30EB, 0x30EC, 0x30ED, 0x30EF, 0x30F3,
+};
+
+uint32_t collate_utf8_decode(const uint8_t **p) {
+    const uint8_t *s = *p;
+    uint32_t cp;
+    int extra;
+
+    if (s[0] < 0x80) {
+        cp = s[0];
+        extra = 0;
+    } else if ((s[0] & 0xE0) == 0xC0) {
+        cp = s[0] & 0x1F;
+        extra = 1;
+    } else if ((s[0] & 0xF0) == 0xE0) {
+        cp = s[0] & 0x0F;
+        extra = 2;
+    } else {
+        cp = s[0] & 0x07;
+        extra = 3;
+    }
+
+    int i = 1;
+    for (; i <= extra && (s[i] & 0xC0) == 0x80; i++) {
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+    *p += i;
+    return i == extra + 1 ? cp : 0xFFFD;
+}
+
+static size_t utf8_encode(uint32_t cp, uint8_t *out) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xC0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xE0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3F);
+    out[2] = 0x80 | ((cp >> 6) & 0x3F);
+    out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+// Voiced (dakuten) or semi-voiced (handakuten) form of a hiragana, the
+// hiragana itself when it has none
+static uint32_t voice(uint32_t cp, bool semi) {
+    if (!semi) {
+        // か-ぢ and つ-ど alternate plain and voiced
+        if (cp >= 0x304B && cp <= 0x3061 && (cp - 0x304B) % 2 == 0) return cp + 1;
+        if (cp >= 0x3064 && cp <= 0x3068 && (cp - 0x3064) % 2 == 0) return cp + 1;
+        if (cp == 0x3046) return 0x3094;
+    }
+    // は-ほ come in threes, plain, voiced and semi-voiced
+    if (cp >= 0x306F && cp <= 0x307B && (cp - 0x306F) % 3 == 0) return cp + (semi ? 2 : 1);
+    return cp;
+}
+
+static uint32_t fold(uint32_t cp) {
+    // Full width ASCII and the ideographic space
+    if (cp >= 0xFF01 && cp <= 0xFF5E) cp -= 0xFEE0;
+    if (cp == 0x3000) cp = ' ';
+
+    if (cp >= 'A' && cp <= 'Z') return cp + ('a' - 'A');
+    if (cp >= 0xC0 && cp <= 0xFF && latin1_fold[cp - 0xC0]) return latin1_fold[cp - 0xC0];
+
+    if (cp >= 0xFF66 && cp <= 0xFF9D) cp = halfwidth_kana[cp - 0xFF66];
+    // Katakana and its iteration marks to hiragana
+    if ((cp >= 0x30A1 && cp <= 0x30F6) || cp == 0x30FD || cp == 0x30FE) return cp - 0x60;
+    return cp;
+}
+
+size_t collate_key(const char *text, uint8_t *out, size_t cap) {
+    const uint8_t *p = (const uint8_t *) text;
+    size_t len = 0;
+    bool space = false;
+    // Last codepoint written and where, for voicing marks to combine with
+    uint32_t last = 0;
+    size_t last_at = 0;
+
+    while (*p) {
+        uint32_t cp = fold(collate_utf8_decode(&p));
+
+        // Half width (ｶﾞ) and combining (か + U+3099) voicing marks follow the
+        // kana they voice, the two become the single voiced hiragana. Both
+        // are hiragana so the key stays the same length.
+        if (cp == 0xFF9E || cp == 0xFF9F || cp == 0x3099 || cp == 0x309A) {
+            uint32_t voiced = voice(last, cp == 0xFF9F || cp == 0x309A);
+            if (voiced != last) {
+                utf8_encode(voiced, out + last_at);
+                last = voiced;
+            }
+            continue;
+        }
+
+        // Whitespace collapses, leading and trailing runs go
+        if (cp == ' ' || cp == '\t') {
+            space = len > 0;
+            last = 0;
+            continue;
+        }
+
+        uint8_t enc[4];
+        size_t n = utf8_encode(cp, enc);
+        if (len + space + n > cap) break;
+
+        if (space) out[len++] = ' ';
+        space = false;
+        last = cp;
+        last_at = len;
+        for (size_t i = 0; i < n; i++) out[len++] = enc[i];
+    }
+    return len;
+}
+
+int collate_jump_bucket(const uint8_t *key, size_t len) {
+    if (len == 0) return 0;
+
+    const uint8_t *p = key;
+    uint32_t cp = collate_utf8_decode(&p);
+    int bucket = 0;
+    while (bucket + 1 < COLLATE_JUMP_COUNT && cp >= jump_start[bucket + 1]) bucket++;
+    return bucket;
+}
@@ -0,0 +1,451 @@
+#include "controls.h"
+#include "audio_playback.h"
+#include "play_clock.h"
+#include "library.h"
+#include "crossfade.h"
+#include "collate.h"
+#include "sd_storage.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/input/input.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(controls);
+
+#define BUTTON_NODE DT_NODELABEL(buttons)
+#define BUTTON_QUEUE_LEN 8
+
+enum gesture {GESTURE_NONE, GESTURE_CLICK, GESTURE_DOUBLE, GESTURE_LONG};
+
+enum mode {MODE_PLAY, MODE_SEEK, MODE_BROWSE, MODE_JUMP, MODE_SEARCH, MODE_SHUFFLE, MODE_CROSSFADE, MODE_COUNT};
+
+static const char *const mode_names[MODE_COUNT] = {
+    "Play", "Seek", "Browse", "Jump", "Search", "Shuffle", "Crossfade"
+};
+
+// Browse scrolls like a jog wheel, speed grows with how far the knob is
+// turned from where it was when the mode started
+#define JOG_DEAD_ZONE 256
+#define JOG_MAX_ROWS_PER_S 40
+
+#define SEARCH_MAX 48
+
+struct search_key {
+    const char *shown;
+    const char *text; // Appended to the search, NULL deletes the last character
+};
+
+// Picked with the knob in Search. The voicing marks are appended as
+// combining characters, collate_key turns か + ゛ into が.
+static const struct search_key search_keys[] = {
+    {"<", NULL}, {"_", " "},
+    {"a", "a"}, {"b", "b"}, {"c", "c"}, {"d", "d"}, {"e", "e"}, {"f", "f"}, {"g", "g"},
+    {"h", "h"}, {"i", "i"}, {"j", "j"}, {"k", "k"}, {"l", "l"}, {"m", "m"}, {"n", "n"},
+    {"o", "o"}, {"p", "p"}, {"q", "q"}, {"r", "r"}, {"s", "s"}, {"t", "t"}, {"u", "u"},
+    {"v", "v"}, {"w", "w"}, {"x", "x"}, {"y", "y"}, {"z", "z"},
+    {"0", "0"}, {"1", "1"}, {"2", "2"}, {"3", "3"}, {"4", "4"}, {"5", "5"}, {"6", "6"},
+    {"7", "7"}, {"8", "8"}, {"9", "9"},
+    {"あ", "あ"}, {"い", "い"}, {"う", "う"}, {"え", "え"}, {"お", "お"},
+    {"か", "か"}, {"き", "き"}, {"く", "く"}, {"け", "け"}, {"こ", "こ"},
+    {"さ", "さ"}, {"し", "し"}, {"す", "す"}, {"せ", "せ"}, {"そ", "そ"},
+    {"た", "た"}, {"ち", "ち"}, {"つ", "つ"}, {"て", "て"}, {"と", "と"},
+    {"な", "な"}, {"に", "に"}, {"ぬ", "ぬ"}, {"ね", "ね"}, {"の", "の"},
+    {"は", "は"}, {"ひ", "ひ"}, {"ふ", "ふ"}, {"へ", "へ"}, {"ほ", "ほ"},
+    {"ま", "ま"}, {"み", "み"}, {"む", "む"}, {"め", "め"}, {"も", "も"},
+    {"や", "や"}, {"ゆ", "ゆ"}, {"よ", "よ"},
+    {"ら", "ら"}, {"り", "り"}, {"る", "る"}, {"れ", "れ"}, {"ろ", "ろ"},
+    {"わ", "わ"}, {"を", "を"}, {"ん", "ん"}, {"っ", "っ"}, {"ー", "ー"},
+    {"゛", "\u3099"}, {"゜", "\u309A"},
+};
+
+#define SEARCH_KEY_COUNT (sizeof(search_keys) / sizeof(search_keys[0]))
+
+struct button_event {
+    int64_t ms;
+    bool pressed;
+};
+
+// Filled from the input thread, drained by the UI loop
+K_MSGQ_DEFINE(button_queue, sizeof(struct button_event), BUTTON_QUEUE_LEN, 4);
+
+static struct k_pipe *pipe;
+static lv_obj_t *label;
+static lv_obj_t *list;
+static char shown[SEARCH_MAX + 16];
+static enum mode mode;
+
+// Gesture decoder state
+static bool down;
+static bool long_sent;
+static int64_t down_ms;
+static int64_t up_ms;
+static int clicks;
+
+static int sent_volume = -CONTROLS_VOL_DEADBAND;
+// Coming back to Play the knob is wherever another mode left it, the volume
+// only follows again once the knob is turned past it
+static bool volume_follows = true;
+static int pickup_side;
+
+static uint32_t seek_target_ms;
+// Crossfade starts off in the audio thread
+static uint32_t sent_crossfade_s;
+
+// Title highlighted in the list, by position in sorted order
+static uint32_t selected;
+static uint32_t selected_track = UINT32_MAX;
+static uint16_t jog_center;
+static int64_t jog_ms;
+static int64_t jog_progress; // Row fraction, in rows * ms / 1000
+static char search[SEARCH_MAX];
+static bool search_found;
+
+static void button_cb(struct input_event *evt, void *user_data) {
+    if (evt->type != INPUT_EV_KEY) return;
+
+    struct button_event event = {.ms = k_uptime_get(), .pressed = evt->value != 0};
+    if (k_msgq_put(&button_queue, &event, K_NO_WAIT) < 0) {
+        LOG_WRN("Button event dropped");
+    }
+}
+
+INPUT_CALLBACK_DEFINE(DEVICE_DT_GET(BUTTON_NODE), button_cb, NULL);
+
+static void send_message(audio_thread_msg *msg) {
+    msg->sent_ticks = k_uptime_ticks();
+    int ret = k_pipe_write(pipe, (uint8_t *) msg, sizeof(*msg), K_FOREVER);
+    if (ret < 0 && ret != -EAGAIN) {
+        LOG_ERR("Write error %d", ret);
+    }
+}
+
+static void send_command(enum message_type type) {
+    audio_thread_msg msg = {.msg_type = type};
+    send_message(&msg);
+}
+
+// Only touches the label when the text changes, it is redrawn otherwise
+static void show(const char *fmt, ...) {
+    char text[sizeof(shown)];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+
+    if (strcmp(text, shown) == 0) return;
+    strcpy(shown, text);
+    lv_label_set_text(label, text);
+}
+
+static enum gesture next_gesture(int64_t now) {
+    struct button_event event;
+
+    while (k_msgq_get(&button_queue, &event, K_NO_WAIT) == 0) {
+        if (event.pressed) {
+            down = true;
+            long_sent = false;
+            down_ms = event.ms;
+            // The UI loop was held up past the double click window
+            if (clicks == 1 && event.ms - up_ms >= CONTROLS_DOUBLE_CLICK_MS) {
+                clicks = 0;
+                return GESTURE_CLICK;
+            }
+            continue;
+        }
+
+        down = false;
+        // The release that ends a long press isn't a click
+        if (long_sent) continue;
+        up_ms = event.ms;
+        if (++clicks == 2) {
+            clicks = 0;
+            return GESTURE_DOUBLE;
+        }
+    }
+
+    if (down && !long_sent && now - down_ms >= CONTROLS_LONG_PRESS_MS) {
+        long_sent = true;
+        clicks = 0;
+        return GESTURE_LONG;
+    }
+    if (!down && clicks == 1 && now - up_ms >= CONTROLS_DOUBLE_CLICK_MS) {
+        clicks = 0;
+        return GESTURE_CLICK;
+    }
+    return GESTURE_NONE;
+}
+
+// Looked up once per track, not on every pass of the UI loop
+static uint32_t track_duration_ms(void) {
+    static uint32_t track = UINT32_MAX;
+    static uint32_t duration_ms;
+    struct library_index_entry entry;
+    uint32_t playing = audio_now_playing();
+
+    if (playing == track) return duration_ms;
+    if (playing == UINT32_MAX || library_get_entry(playing, &entry) < 0) return 0;
+    track = playing;
+    duration_ms = entry.duration_ms;
+    return duration_ms;
+}
+
+static void enter_mode(enum mode next, uint16_t knob) {
+    mode = next;
+    switch (mode) {
+        case MODE_PLAY:
+            volume_follows = sent_volume < 0;
+            pickup_side = knob < sent_volume ? -1 : 1;
+        break;
+        case MODE_BROWSE:
+            jog_center = knob;
+            jog_ms = k_uptime_get();
+            jog_progress = 0;
+        break;
+        case MODE_SEARCH:
+            search[0] = '\0';
+            search_found = true;
+        break;
+        default:
+        break;
+    }
+}
+
+// Moves the list highlight, the list refills around it as needed
+static void select_title(int64_t pos) {
+    uint32_t count = library_count();
+    uint32_t track;
+
+    if (count == 0) return;
+    pos = MAX(MIN(pos, (int64_t) count - 1), 0);
+    if (select_list_position(list, pos, &track) == 0) {
+        selected = pos;
+        selected_track = track;
+    }
+}
+
+static void play_selected(void) {
+    if (selected_track == UINT32_MAX) return;
+
+    audio_thread_msg msg = {.msg_type = PLAY, .track_id = selected_track};
+    send_message(&msg);
+}
+
+// Sorted position the cursor points at
+static void select_cursor(const struct library_cursor *cursor) {
+    uint32_t pos;
+    if (library_sort_tell(cursor, &pos) == 0) select_title(pos);
+}
+
+static void update_play(uint16_t knob, enum gesture gesture) {
+    int distance = (int) knob - sent_volume;
+    if (!volume_follows && (abs(distance) < CONTROLS_VOL_DEADBAND || (distance < 0 ? -1 : 1) != pickup_side)) {
+        volume_follows = true;
+    }
+    // Only real changes go out, ADC noise would keep the pipe full
+    if (volume_follows && abs(distance) >= CONTROLS_VOL_DEADBAND) {
+        audio_thread_msg msg = {.msg_type = VOL, .volume = knob};
+        send_message(&msg);
+        sent_volume = knob;
+    }
+
+    switch (gesture) {
+        case GESTURE_CLICK: {
+            struct play_clock_snapshot position;
+            play_clock_get(&position);
+            send_command(position.paused ? RESUME : PAUSE);
+        }
+        break;
+        case GESTURE_DOUBLE:
+            send_command(NEXT);
+        break;
+        default:
+        break;
+    }
+
+    show(volume_follows ? "Vol %d" : "Vol %d (turn)", sent_volume < 0 ? 0 : sent_volume);
+}
+
+static void update_seek(uint16_t knob, enum gesture gesture) {
+    uint32_t duration_ms = track_duration_ms();
+    seek_target_ms = (uint32_t) ((uint64_t) MIN(knob, CONTROLS_KNOB_MAX) * duration_ms / CONTROLS_KNOB_MAX);
+
+    switch (gesture) {
+        case GESTURE_CLICK: {
+            audio_thread_msg msg = {.msg_type = SEEK, .position_ms = seek_target_ms};
+            send_message(&msg);
+        }
+        break;
+        case GESTURE_DOUBLE:
+            send_command(PREV);
+        break;
+        default:
+        break;
+    }
+
+    uint32_t seconds = seek_target_ms / 1000;
+    show("Seek %u:%02u", seconds / 60, seconds % 60);
+}
+
+static void update_browse(uint16_t knob, enum gesture gesture) {
+    int64_t now = k_uptime_get();
+    int offset = (int) knob - jog_center;
+
+    if (abs(offset) > JOG_DEAD_ZONE) {
+        int speed = offset > 0 ? offset - JOG_DEAD_ZONE : offset + JOG_DEAD_ZONE;
+        jog_progress += (int64_t) speed * JOG_MAX_ROWS_PER_S * (now - jog_ms)
+                        / (CONTROLS_KNOB_MAX / 2 - JOG_DEAD_ZONE);
+        int64_t rows = jog_progress / 1000;
+        if (rows != 0) {
+            jog_progress -= rows * 1000;
+            select_title((int64_t) selected + rows);
+        }
+    } else {
+        jog_progress = 0;
+    }
+    jog_ms = now;
+
+    if (gesture == GESTURE_CLICK) play_selected();
+
+    if (library_count() == 0) {
+        show("No library");
+    } else {
+        show("%u/%u", selected + 1, library_count());
+    }
+}
+
+static void update_jump(uint16_t knob, enum gesture gesture) {
+    int bucket = (uint32_t) MIN(knob, CONTROLS_KNOB_MAX) * COLLATE_JUMP_COUNT / (CONTROLS_KNOB_MAX + 1);
+
+    // Jumps and hands the knob over to Browse from there
+    if (gesture == GESTURE_CLICK) {
+        struct library_cursor cursor;
+        if (library_sort_jump(LIBRARY_SORT_TITLE, bucket, &cursor) == 0) {
+            select_cursor(&cursor);
+            enter_mode(MODE_BROWSE, knob);
+            return;
+        }
+    }
+
+    show("Jump %s", collate_jump_labels[bucket]);
+}
+
+static void update_search(uint16_t knob, enum gesture gesture) {
+    const struct search_key *key = &search_keys[(uint32_t) MIN(knob, CONTROLS_KNOB_MAX) * SEARCH_KEY_COUNT
+                                                / (CONTROLS_KNOB_MAX + 1)];
+
+    switch (gesture) {
+        case GESTURE_CLICK: {
+            size_t len = strlen(search);
+            if (key->text) {
+                if (len + strlen(key->text) < sizeof(search)) strcat(search, key->text);
+            } else {
+                // Back over a whole UTF-8 sequence
+                while (len > 0 && (search[--len] & 0xC0) == 0x80) {}
+                search[len] = '\0';
+            }
+
+            struct library_cursor cursor;
+            int rc = library_sort_find(LIBRARY_SORT_TITLE, search, &cursor);
+            search_found = rc == 0;
+            if (rc == 0 || rc == -ENOENT) select_cursor(&cursor);
+        }
+        break;
+        case GESTURE_DOUBLE:
+            play_selected();
+        break;
+        default:
+        break;
+    }
+
+    show("%s%s[%s]", search_found ? "" : "? ", search, key->shown);
+}
+
+static void update_shuffle(enum gesture gesture) {
+    bool shuffle = audio_shuffled();
+
+    if (gesture == GESTURE_CLICK) {
+        audio_thread_msg msg = {.msg_type = SHUFFLE, .shuffle = !shuffle};
+        send_message(&msg);
+    }
+
+    show("Shuffle %s", shuffle ? "on" : "off");
+}
+
+static void update_crossfade(uint16_t knob, enum gesture gesture) {
+    uint32_t seconds = (uint32_t) MIN(knob, CONTROLS_KNOB_MAX) * (CROSSFADE_MAX_MS / 1000) / CONTROLS_KNOB_MAX;
+
+    if (gesture == GESTURE_CLICK) {
+        audio_thread_msg msg = {.msg_type = CROSSFADE, .duration_ms = seconds * 1000};
+        send_message(&msg);
+        sent_crossfade_s = seconds;
+    }
+
+    if (seconds != sent_crossfade_s) {
+        show("Fade %u s?", seconds);
+        return;
+    }
+    if (seconds == 0) {
+        show("Fade off");
+        return;
+    }
+
+    // Worst dual decode so far against the block deadline
+    struct crossfade_stats stats;
+    crossfade_get_stats(&stats);
+    if (stats.fades == 0) {
+        show("Fade %u s", seconds);
+    } else {
+        show("Fade %u s, peak %u%%", seconds, stats.worst_peak_us * 100 / stats.worst_block_us);
+    }
+}
+
+void controls_init(struct k_pipe *command_pipe, lv_obj_t *status_label, lv_obj_t *track_list) {
+    pipe = command_pipe;
+    label = status_label;
+    list = track_list;
+    if (!device_is_ready(DEVICE_DT_GET(BUTTON_NODE))) {
+        LOG_ERR("Button is not ready, only the volume works");
+    }
+}
+
+void controls_update(uint16_t knob) {
+    enum gesture gesture = next_gesture(k_uptime_get());
+
+    if (gesture == GESTURE_LONG) {
+        enter_mode((mode + 1) % MODE_COUNT, knob);
+        LOG_INF("Mode %s", mode_names[mode]);
+        gesture = GESTURE_NONE;
+    }
+
+    switch (mode) {
+        case MODE_PLAY:
+            update_play(knob, gesture);
+        break;
+        case MODE_SEEK:
+            update_seek(knob, gesture);
+        break;
+        case MODE_BROWSE:
+            update_browse(knob, gesture);
+        break;
+        case MODE_JUMP:
+            update_jump(knob, gesture);
+        break;
+        case MODE_SEARCH:
+            update_search(knob, gesture);
+        break;
+        case MODE_SHUFFLE:
+            update_shuffle(gesture);
+        break;
+        case MODE_CROSSFADE:
+            update_crossfade(knob, gesture);
+        break;
+        default:
+        break;
+    }
+}
@@ -0,0 +1,227 @@
+#include "crossfade.h"
+#include "audio_playback.h"
+#include "card_layout.h"
+#include "clock_governor.h"
+
+#include <math.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#ifdef __ARM_FEATURE_SIMD32
+#include <arm_acle.h>
+#endif
+
+LOG_MODULE_REGISTER(crossfade, LOG_LEVEL_DBG);
+
+#define GAIN_STEPS 256
+// Gains are stepped every this many frames, well under a millisecond
+#define GAIN_CHUNK 32
+
+K_HEAP_DEFINE(crossfade_heap, CROSSFADE_HEAP_SIZE);
+
+// Quarter sine in Q15, the incoming gain is sin, the outgoing one cos
+static int16_t gain_table[GAIN_STEPS + 1];
+
+struct outgoing {
+    bool active;
+    struct fs_file_t file;
+    opus_state_t st;
+    OpusDecoder *dec;
+    uint8_t *packet;
+    int16_t *pcm;
+    uint32_t pcm_frames;
+    uint32_t pcm_pos;
+    uint32_t discard;
+    bool eof;
+
+    uint32_t fade_pos;
+    uint32_t fade_len;
+    // The block that came closest to its deadline
+    uint32_t peak_us;
+    uint32_t peak_block_us;
+};
+
+static struct outgoing out;
+static struct crossfade_stats stats;
+
+void crossfade_init(void) {
+    for (int i = 0; i <= GAIN_STEPS; i++) {
+        gain_table[i] = (int16_t) lrintf(sinf((float) i / GAIN_STEPS * (float) M_PI / 2) * 32767);
+    }
+}
+
+static void release(void) {
+    if (out.dec) k_heap_free(&crossfade_heap, out.dec);
+    if (out.packet) k_heap_free(&crossfade_heap, out.packet);
+    if (out.pcm) k_heap_free(&crossfade_heap, out.pcm);
+    out.dec = NULL;
+    out.packet = NULL;
+    out.pcm = NULL;
+}
+
+int crossfade_begin(struct fs_file_t *file, const opus_state_t *st, const OpusDecoder *dec,
+                    uint32_t discard, uint32_t fade_samples) {
+    if (out.active) crossfade_cancel();
+
+    size_t dec_size = opus_decoder_get_size(CHANNELS);
+    out.dec = k_heap_alloc(&crossfade_heap, dec_size, K_NO_WAIT);
+    out.packet = k_heap_alloc(&crossfade_heap, CARD_MAX_PACKET, K_NO_WAIT);
+    out.pcm = k_heap_alloc(&crossfade_heap, SAMPLE_NO * CHANNELS * sizeof(int16_t), K_NO_WAIT);
+    if (!out.dec || !out.packet || !out.pcm) {
+        LOG_WRN("Crossfade needs %u bytes of decoder, budget exhausted", dec_size);
+        release();
+        return -ENOMEM;
+    }
+
+    // Decoder state has no pointers into itself, a copy carries on where it left off
+    memcpy(out.dec, dec, dec_size);
+    out.file = *file;
+    out.st = *st;
+    out.pcm_frames = 0;
+    out.pcm_pos = 0;
+    out.discard = discard;
+    out.eof = false;
+    out.fade_pos = 0;
+    out.fade_len = MAX(fade_samples, 1);
+    out.peak_us = 0;
+    out.peak_block_us = 1;
+    out.active = true;
+
+    LOG_INF("Crossfade over %u ms", fade_samples * 1000 / SAMPLE_RATE);
+    return 0;
+}
+
+bool crossfade_active(void) {
+    return out.active;
+}
+
+static void finish(void) {
+    stats.fades++;
+    stats.last_peak_us = out.peak_us;
+    stats.last_block_us = out.peak_block_us;
+    if (stats.fades == 1 || (uint64_t) out.peak_us * stats.worst_block_us > (uint64_t) stats.worst_peak_us * out.peak_block_us) {
+        stats.worst_peak_us = out.peak_us;
+        stats.worst_block_us = out.peak_block_us;
+    }
+    LOG_INF("Crossfade done, dual decode peak %u us of a %u us block (%u%%)",
+            out.peak_us, out.peak_block_us, out.peak_us * 100 / out.peak_block_us);
+
+    fs_close(&out.file);
+    release();
+    out.active = false;
+}
+
+void crossfade_get_stats(struct crossfade_stats *out_stats) {
+    *out_stats = stats;
+}
+
+void crossfade_cancel(void) {
+    if (!out.active) return;
+
+    fs_close(&out.file);
+    release();
+    out.active = false;
+}
+
+// Refills the PCM buffer with the next packet of the outgoing track
+static void decode_outgoing(void) {
+    uint16_t packet_size;
+    out.pcm_pos = 0;
+    out.pcm_frames = 0;
+
+    while (out.pcm_frames == 0 && !out.eof) {
+        int rc = opus_get_packet(&out.st, out.packet, &packet_size, &out.file);
+        if (rc != OP_OK && rc != OP_DONE) {
+            out.eof = true;
+            return;
+        }
+        if (rc == OP_DONE) out.eof = true;
+
+        int frames = opus_decode(out.dec, out.packet, packet_size, out.pcm, SAMPLE_NO, 0);
+        if (frames <= 0) continue;
+
+        out.pcm_frames = frames;
+        if (out.discard > 0) {
+            uint32_t skip = MIN(out.discard, out.pcm_frames);
+            out.pcm_pos = skip;
+            out.discard -= skip;
+        }
+        if (out.pcm_pos == out.pcm_frames) out.pcm_frames = 0;
+    }
+}
+
+// dst = dst * g_in + src * g_out, both Q15, per sample
+static void mix(int16_t *dst, const int16_t *src, uint32_t frames, int16_t g_in, int16_t g_out) {
+#ifdef __ARM_FEATURE_SIMD32
+    // A stereo frame is one word, left in the bottom halfword. PKHBT/PKHTB
+    // pair each incoming sample with its outgoing one so a single SMUAD
+    // against the paired gains does both multiplies and the add.
+    uint32_t *d = (uint32_t *) dst;
+    const uint32_t *s = (const uint32_t *) src;
+    uint32_t gains = __pkhbt((uint16_t) g_in, (uint16_t) g_out, 16);
+    for (uint32_t i = 0; i < frames; i++) {
+        uint32_t in = d[i];
+        uint32_t outgoing = s[i];
+        int32_t left = __smuad(__pkhbt(in, outgoing, 16), gains);
+        int32_t right = __smuad(__pkhtb(outgoing, in, 16), gains);
+        d[i] = __pkhbt(__ssat(left >> 15, 16), __ssat(right >> 15, 16), 16);
+    }
+#else
+    for (uint32_t i = 0; i < frames * CHANNELS; i++) {
+        int32_t v = ((int32_t) dst[i] * g_in + (int32_t) src[i] * g_out) >> 15;
+        dst[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+    }
+#endif
+}
+
+uint32_t crossfade_apply(int16_t *block, uint32_t frames, uint32_t primary_us) {
+    if (!out.active) return 0;
+
+    timing_t start = timing_counter_get();
+    uint32_t done = 0;
+
+    while (done < frames && out.fade_pos < out.fade_len) {
+        if (out.pcm_pos == out.pcm_frames) {
+            decode_outgoing();
+            if (out.pcm_frames == 0) break;
+        }
+
+        uint32_t n = MIN(frames - done, out.pcm_frames - out.pcm_pos);
+        n = MIN(n, GAIN_CHUNK);
+        n = MIN(n, out.fade_len - out.fade_pos);
+
+        uint32_t step = (uint64_t) out.fade_pos * GAIN_STEPS / out.fade_len;
+        mix(block + done * CHANNELS, out.pcm + out.pcm_pos * CHANNELS, n,
+            gain_table[step], gain_table[GAIN_STEPS - step]);
+
+        done += n;
+        out.pcm_pos += n;
+        out.fade_pos += n;
+    }
+
+    // The outgoing track ran out before the fade did, the rest still fades in
+    while (done < frames && out.fade_pos < out.fade_len) {
+        uint32_t n = MIN(frames - done, GAIN_CHUNK);
+        n = MIN(n, out.fade_len - out.fade_pos);
+        uint32_t step = (uint64_t) out.fade_pos * GAIN_STEPS / out.fade_len;
+        int16_t *pcm = block + done * CHANNELS;
+        for (uint32_t i = 0; i < n * CHANNELS; i++) {
+            pcm[i] = ((int32_t) pcm[i] * gain_table[step]) >> 15;
+        }
+        done += n;
+        out.fade_pos += n;
+    }
+
+    uint32_t fade_us = clock_governor_work_us(start, timing_counter_get());
+    uint32_t block_us = FRAMES_TO_US(frames);
+    if ((uint64_t) (primary_us + fade_us) * out.peak_block_us > (uint64_t) out.peak_us * block_us) {
+        out.peak_us = primary_us + fade_us;
+        out.peak_block_us = block_us;
+    }
+
+    if (out.fade_pos >= out.fade_len) {
+        finish();
+    }
+    return fade_us;
+}
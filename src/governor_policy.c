@@ -0,0 +1,53 @@
+#include "governor_policy.h"
+
+#include <string.h>
+
+const uint8_t gov_dividers[GOV_LEVEL_COUNT] = {1, 2, 4};
+
+void gov_init(struct gov_state *st, const struct gov_config *cfg) {
+    memset(st, 0, sizeof(*st));
+    st->cfg = *cfg;
+}
+
+static uint32_t load_at(const struct gov_state *st, uint8_t level) {
+    return st->peak_load * gov_dividers[level];
+}
+
+uint8_t gov_update(struct gov_state *st, uint32_t work_us, uint32_t block_us, uint32_t in_flight) {
+    st->blocks++;
+    st->level_blocks[st->level]++;
+
+    if (block_us == 0) return st->level;
+
+    // Normalise to what the block would have cost at full speed
+    uint32_t load = (uint32_t)(((uint64_t)work_us * 10000) / block_us) / gov_dividers[st->level];
+
+    uint32_t decayed = st->peak_load - ((st->peak_load * st->cfg.peak_decay) >> 10);
+    st->peak_load = load > decayed ? load : decayed;
+
+    if (in_flight == 0) {
+        // DMA ran dry, go straight back to full speed
+        st->misses++;
+        st->level = 0;
+        st->calm_blocks = 0;
+        return st->level;
+    }
+
+    if (load_at(st, st->level) > st->cfg.up_load) {
+        while (st->level > 0 && load_at(st, st->level) > st->cfg.up_load) {
+            st->level--;
+        }
+        st->calm_blocks = 0;
+        return st->level;
+    }
+
+    if (st->level + 1 < GOV_LEVEL_COUNT && load_at(st, st->level + 1) < st->cfg.down_load) {
+        if (++st->calm_blocks >= st->cfg.hold_blocks) {
+            st->level++;
+            st->calm_blocks = 0;
+        }
+    } else {
+        st->calm_blocks = 0;
+    }
+    return st->level;
+}
@@ -0,0 +1,45 @@
+#include "latency_probe.h"
+
+#include <string.h>
+
+void latency_probe_init(struct latency_probe *p) {
+    memset(p, 0, sizeof(*p));
+    p->response_ahead = -1;
+}
+
+void latency_probe_cancel(struct latency_probe *p) {
+    p->command_pending = false;
+    p->response_ahead = -1;
+}
+
+void latency_probe_command(struct latency_probe *p, int64_t sent_us) {
+    p->command_us = sent_us;
+    p->command_pending = true;
+    p->response_ahead = -1;
+}
+
+static bool audible(struct latency_probe *p, int64_t now_us, uint32_t *latency_us) {
+    int64_t latency = now_us - p->command_us;
+    *latency_us = latency > 0 ? (uint32_t) latency : 0;
+    p->response_ahead = -1;
+    p->responses++;
+    if (*latency_us > p->worst_us) p->worst_us = *latency_us;
+    return true;
+}
+
+bool latency_probe_response(struct latency_probe *p, uint32_t ahead, int64_t now_us, uint32_t *latency_us) {
+    if (!p->command_pending) return false;
+    p->command_pending = false;
+
+    p->response_ahead = ahead;
+    // The DMA was dry, the response went straight out
+    if (ahead == 0) return audible(p, now_us, latency_us);
+    return false;
+}
+
+bool latency_probe_block_played(struct latency_probe *p, int64_t now_us, uint32_t *latency_us) {
+    if (p->response_ahead > 0 && --p->response_ahead == 0) {
+        return audible(p, now_us, latency_us);
+    }
+    return false;
+}
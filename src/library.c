@@ -0,0 +1,379 @@
+#include "library.h"
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(library, LOG_LEVEL_DBG);
+
+// The index stays open, lookups from the audio thread and the UI share it
+static struct fs_file_t index_file;
+static struct library_index_header header;
+static bool index_open;
+K_MUTEX_DEFINE(index_lock);
+
+// Recently read sort blocks, a jump or search usually revisits the last one
+#define SORT_CACHE_BLOCKS 4
+
+struct sort_block {
+    bool valid;
+    uint8_t field;
+    uint32_t block;
+    uint32_t last_used;
+    uint8_t data[LIBRARY_SORT_BLOCK_SIZE];
+};
+
+struct sort_entry {
+    uint8_t key[COLLATE_KEY_MAX];
+    size_t len;
+    uint32_t track;
+};
+
+static struct sort_block sort_cache[SORT_CACHE_BLOCKS];
+static uint32_t sort_cache_clock;
+static uint32_t sort_block_reads;
+// Card reads the last library_sort_find needed
+static uint32_t last_find_reads;
+
+int library_open(void) {
+    k_mutex_lock(&index_lock, K_FOREVER);
+    if (index_open) {
+        k_mutex_unlock(&index_lock);
+        return 0;
+    }
+
+    fs_file_t_init(&index_file);
+    int rc = fs_open(&index_file, LIBRARY_INDEX_PATH, FS_O_READ);
+    if (rc < 0) {
+        LOG_ERR("No library index, run cardprep on the card: %d", rc);
+        k_mutex_unlock(&index_lock);
+        return rc;
+    }
+
+    ssize_t rd = fs_read(&index_file, &header, sizeof(header));
+    if (rd != sizeof(header) || memcmp(header.magic, LIBRARY_INDEX_MAGIC, 4) != 0
+        || header.version != LIBRARY_INDEX_VERSION || header.entry_size < sizeof(struct library_index_entry)) {
+        LOG_ERR("Library index is not valid");
+        fs_close(&index_file);
+        k_mutex_unlock(&index_lock);
+        return -EINVAL;
+    }
+
+    index_open = true;
+    k_mutex_unlock(&index_lock);
+
+    LOG_INF("Library has %u tracks", header.track_count);
+    return 0;
+}
+
+uint32_t library_count(void) {
+    return index_open ? header.track_count : 0;
+}
+
+static int read_at(off_t offset, void *buf, size_t len) {
+    int rc = fs_seek(&index_file, offset, FS_SEEK_SET);
+    if (rc < 0) return rc;
+
+    ssize_t rd = fs_read(&index_file, buf, len);
+    return rd < 0 ? rd : (int) rd;
+}
+
+int library_get_entry(uint32_t id, struct library_index_entry *out) {
+    if (id >= library_count()) return -EINVAL;
+
+    k_mutex_lock(&index_lock, K_FOREVER);
+    int rc = read_at(header.entries_offset + (off_t) id * header.entry_size, out, sizeof(*out));
+    k_mutex_unlock(&index_lock);
+
+    return rc == sizeof(*out) ? 0 : -EIO;
+}
+
+int library_get_string(uint32_t offset, char *buf, size_t len) {
+    if (!index_open || offset >= header.strings_size || len == 0) return -EINVAL;
+
+    size_t avail = MIN(len - 1, header.strings_size - offset);
+    k_mutex_lock(&index_lock, K_FOREVER);
+    int rc = read_at(header.strings_offset + offset, buf, avail);
+    k_mutex_unlock(&index_lock);
+
+    if (rc < 0) return rc;
+    buf[rc] = 0;
+    return 0;
+}
+
+int library_get_path(uint32_t id, char *buf, size_t len) {
+    struct library_index_entry entry;
+    int rc = library_get_entry(id, &entry);
+    if (rc < 0) return rc;
+
+    size_t prefix = strlen("/SD:/");
+    if (len <= prefix) return -EINVAL;
+    memcpy(buf, "/SD:/", prefix);
+    return library_get_string(entry.path, buf + prefix, len - prefix);
+}
+
+// Called with index_lock held
+static const uint8_t *get_sort_block(uint8_t field, uint32_t block) {
+    const struct library_sort_table *table = &header.sort[field];
+    if (block >= table->block_count) return NULL;
+
+    struct sort_block *victim = &sort_cache[0];
+    for (int i = 0; i < SORT_CACHE_BLOCKS; i++) {
+        struct sort_block *c = &sort_cache[i];
+        if (c->valid && c->field == field && c->block == block) {
+            c->last_used = ++sort_cache_clock;
+            return c->data;
+        }
+        if (!c->valid || c->last_used < victim->last_used) victim = c;
+    }
+
+    victim->valid = false;
+    off_t offset = table->blocks_offset + (off_t) block * LIBRARY_SORT_BLOCK_SIZE;
+    if (read_at(offset, victim->data, LIBRARY_SORT_BLOCK_SIZE) != LIBRARY_SORT_BLOCK_SIZE) return NULL;
+    sort_block_reads++;
+
+    const struct library_sort_block_header *bh = (const void *) victim->data;
+    if (bh->count == 0 || bh->size < sizeof(*bh) || bh->size > LIBRARY_SORT_BLOCK_SIZE) {
+        LOG_ERR("Sort block %u of table %u is not valid", block, field);
+        return NULL;
+    }
+
+    victim->valid = true;
+    victim->field = field;
+    victim->block = block;
+    victim->last_used = ++sort_cache_clock;
+    return victim->data;
+}
+
+// Decodes the entry at *pos, entry must still hold the one before it
+static int decode_sort_entry(const uint8_t *data, size_t *pos, struct sort_entry *entry) {
+    const struct library_sort_block_header *bh = (const void *) data;
+    size_t p = *pos;
+
+    if (p + 2 > bh->size) return -EIO;
+    uint8_t shared = data[p];
+    uint8_t suffix = data[p + 1];
+    p += 2;
+    if (shared > entry->len || shared + suffix > COLLATE_KEY_MAX || p + suffix > bh->size) return -EIO;
+
+    memcpy(entry->key + shared, data + p, suffix);
+    entry->len = shared + suffix;
+    p += suffix;
+
+    entry->track = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (p >= bh->size) return -EIO;
+        uint8_t b = data[p++];
+        entry->track |= (uint32_t) (b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *pos = p;
+            return 0;
+        }
+    }
+    return -EIO;
+}
+
+// Decodes entries of a block up to and including index
+static int read_sort_entry(const uint8_t *data, uint16_t index, struct sort_entry *entry) {
+    const struct library_sort_block_header *bh = (const void *) data;
+    if (index >= bh->count) return -EINVAL;
+
+    size_t pos = sizeof(*bh);
+    entry->len = 0;
+    for (uint16_t i = 0; i <= index; i++) {
+        int rc = decode_sort_entry(data, &pos, entry);
+        if (rc < 0) return rc;
+    }
+    return 0;
+}
+
+static int compare_keys(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len) {
+    int c = memcmp(a, b, MIN(a_len, b_len));
+    if (c != 0) return c;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+// Called with index_lock held
+static int sort_jump(enum library_sort_field field, int bucket, struct library_cursor *cursor) {
+    if (!index_open || field >= LIBRARY_SORT_COUNT || bucket < 0 || bucket >= COLLATE_JUMP_COUNT) {
+        return -EINVAL;
+    }
+
+    cursor->field = field;
+    cursor->block = header.sort[field].jump[bucket].block;
+    cursor->index = header.sort[field].jump[bucket].index;
+    return 0;
+}
+
+int library_sort_jump(enum library_sort_field field, int bucket, struct library_cursor *cursor) {
+    k_mutex_lock(&index_lock, K_FOREVER);
+    int rc = sort_jump(field, bucket, cursor);
+    k_mutex_unlock(&index_lock);
+    return rc;
+}
+
+int library_sort_find(enum library_sort_field field, const char *text, struct library_cursor *cursor) {
+    uint8_t key[COLLATE_KEY_MAX];
+    size_t key_len = collate_key(text, key, sizeof(key));
+
+    uint32_t start = k_cycle_get_32();
+    k_mutex_lock(&index_lock, K_FOREVER);
+    sort_block_reads = 0;
+
+    // The jump table bounds the blocks the key can be in
+    int bucket = collate_jump_bucket(key, key_len);
+    int rc = sort_jump(field, bucket, cursor);
+    if (rc < 0) goto out;
+
+    const struct library_sort_table *table = &header.sort[field];
+    uint32_t lo = cursor->block;
+    if (lo >= table->block_count) {
+        rc = -ENOENT;
+        goto out;
+    }
+    uint32_t hi = bucket + 1 < COLLATE_JUMP_COUNT ? table->jump[bucket + 1].block : table->block_count;
+    if (hi >= table->block_count) hi = table->block_count - 1;
+
+    // Last block that starts before the key, by its uncompressed first entry
+    struct sort_entry entry;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        const uint8_t *data = get_sort_block(field, mid);
+        if (!data || read_sort_entry(data, 0, &entry) < 0) {
+            rc = -EIO;
+            goto out;
+        }
+        if (compare_keys(entry.key, entry.len, key, key_len) < 0) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    const uint8_t *data = get_sort_block(field, lo);
+    if (!data) {
+        rc = -EIO;
+        goto out;
+    }
+
+    const struct library_sort_block_header *bh = (const void *) data;
+    size_t pos = sizeof(*bh);
+    uint16_t index = 0;
+    entry.len = 0;
+    for (; index < bh->count; index++) {
+        rc = decode_sort_entry(data, &pos, &entry);
+        if (rc < 0) goto out;
+        if (compare_keys(entry.key, entry.len, key, key_len) >= 0) break;
+    }
+
+    cursor->block = lo;
+    cursor->index = index;
+    if (index == bh->count) {
+        // Everything in this block sorts first, the match starts the next one
+        cursor->block = lo + 1;
+        cursor->index = 0;
+        data = get_sort_block(field, cursor->block);
+        if (!data || read_sort_entry(data, 0, &entry) < 0) {
+            rc = -ENOENT;
+            goto out;
+        }
+    }
+
+    rc = entry.len >= key_len && memcmp(entry.key, key, key_len) == 0 ? 0 : -ENOENT;
+
+out:
+    last_find_reads = sort_block_reads;
+    k_mutex_unlock(&index_lock);
+    LOG_DBG("Search took %u block reads in %u us", last_find_reads, k_cyc_to_us_floor32(k_cycle_get_32() - start));
+    return rc;
+}
+
+uint32_t library_sort_find_reads(void) {
+    return last_find_reads;
+}
+
+int library_sort_seek(enum library_sort_field field, uint32_t pos, struct library_cursor *cursor) {
+    k_mutex_lock(&index_lock, K_FOREVER);
+    if (!index_open || field >= LIBRARY_SORT_COUNT) {
+        k_mutex_unlock(&index_lock);
+        return -EINVAL;
+    }
+
+    // Last block starting at or before pos
+    const struct library_sort_table *table = &header.sort[field];
+    int rc = 0;
+    uint32_t lo = 0;
+    uint32_t hi = table->block_count;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const uint8_t *data = get_sort_block(field, mid);
+        if (!data) {
+            rc = -EIO;
+            break;
+        }
+        const struct library_sort_block_header *bh = (const void *) data;
+        if (bh->first_pos <= pos) lo = mid;
+        else hi = mid;
+    }
+
+    const uint8_t *data = rc == 0 ? get_sort_block(field, lo) : NULL;
+    if (data) {
+        const struct library_sort_block_header *bh = (const void *) data;
+        cursor->field = field;
+        cursor->block = lo;
+        cursor->index = pos - bh->first_pos;
+        if (pos < bh->first_pos || cursor->index >= bh->count) rc = -ENOENT;
+    } else if (rc == 0) {
+        rc = -ENOENT;
+    }
+    k_mutex_unlock(&index_lock);
+    return rc;
+}
+
+int library_sort_tell(const struct library_cursor *cursor, uint32_t *pos) {
+    k_mutex_lock(&index_lock, K_FOREVER);
+    if (!index_open || cursor->field >= LIBRARY_SORT_COUNT) {
+        k_mutex_unlock(&index_lock);
+        return -EINVAL;
+    }
+
+    int rc = 0;
+    if (cursor->block >= header.sort[cursor->field].block_count) {
+        *pos = header.track_count;
+    } else {
+        const uint8_t *data = get_sort_block(cursor->field, cursor->block);
+        if (data) {
+            const struct library_sort_block_header *bh = (const void *) data;
+            *pos = bh->first_pos + cursor->index;
+        } else {
+            rc = -EIO;
+        }
+    }
+    k_mutex_unlock(&index_lock);
+    return rc;
+}
+
+int library_sort_next(struct library_cursor *cursor, uint32_t *track) {
+    if (!index_open || cursor->field >= LIBRARY_SORT_COUNT) return -EINVAL;
+
+    k_mutex_lock(&index_lock, K_FOREVER);
+    const uint8_t *data = get_sort_block(cursor->field, cursor->block);
+    if (!data) {
+        k_mutex_unlock(&index_lock);
+        return cursor->block >= header.sort[cursor->field].block_count ? -ENOENT : -EIO;
+    }
+
+    struct sort_entry entry;
+    int rc = read_sort_entry(data, cursor->index, &entry);
+    if (rc == 0) {
+        *track = entry.track;
+        const struct library_sort_block_header *bh = (const void *) data;
+        if (++cursor->index == bh->count) {
+            cursor->block++;
+            cursor->index = 0;
+        }
+    }
+    k_mutex_unlock(&index_lock);
+    return rc;
+}
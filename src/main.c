@@ -20,6 +20,12 @@
 
 #include "sd_storage.h"
 #include "audio_playback.h"
+#include "visualizer.h"
+#include "play_clock.h"
+#include "boot_prof.h"
+#include "sd_font.h"
+#include "library.h"
+#include "controls.h"
 
 LOG_MODULE_REGISTER(main);
 
@@ -31,6 +37,10 @@ static const struct adc_dt_spec adc_chan =ADC_DT_SPEC_GET(DT_PATH(zephyr_user));
 #define AUDIO_THREAD_PRIO 1
 #define INPUT_THREAD_PRIO 2
 
+// Longest the UI loop sleeps between passes. Main runs above every other
+// thread, a pass that doesn't sleep starves audio, fonts and the visualizer.
+#define UI_PERIOD_MS 10
+
 K_PIPE_DEFINE(pipe, 256, 4);
 
 uint16_t read_potentiometer(const struct adc_dt_spec *adc_cha)
@@ -63,9 +73,51 @@ uint16_t read_potentiometer(const struct adc_dt_spec *adc_cha)
     return buf;
 } 
 
+// Queues glyphs for the rows on screen and a screen's worth either side
+static void prefetch_visible_rows(lv_obj_t *list) {
+    lv_area_t view;
+    lv_obj_get_coords(list, &view);
+    int32_t margin = lv_obj_get_height(list);
+    view.y1 -= margin;
+    view.y2 += margin;
+
+    for (uint32_t i = 0; i < lv_obj_get_child_count(list); i++) {
+        lv_obj_t *row = lv_obj_get_child(list, i);
+        lv_area_t area;
+        lv_obj_get_coords(row, &area);
+        if (area.y2 < view.y1 || area.y1 > view.y2) continue;
+
+        sd_font_prefetch(lv_label_get_text(row));
+    }
+}
+
+static void list_scroll_cb(lv_event_t *e) {
+    prefetch_visible_rows(lv_event_get_target(e));
+}
+
+// Shows the title of the track being played, returns false if it can't be looked up yet
+static bool show_now_playing(lv_obj_t *title_label, uint32_t track) {
+    char title[LIBRARY_PATH_MAX];
+    struct library_index_entry entry;
+
+    if (track == UINT32_MAX) {
+        lv_label_set_text(title_label, "");
+        return true;
+    }
+    if (library_get_entry(track, &entry) < 0 || library_get_string(entry.title, title, sizeof(title)) < 0) {
+        return false;
+    }
+
+    sd_font_prefetch(title);
+    lv_label_set_text(title_label, title);
+    return true;
+}
+
 int main(void)
 {
-    setup_disk();
+    boot_mark(BOOT_MAIN);
+    // Mounting runs on the workqueue while the display comes up
+    setup_disk_async();
 	int ret;
     disp = DEVICE_DT_GET(DISP_NODE);
     if(!device_is_ready(disp)) {
@@ -83,8 +135,23 @@ int main(void)
     lv_obj_set_style_bg_color(list, lv_color_black(), 0);
     lv_obj_set_size(list, 256,64);
 
-    populate_list_with_files(list);
-    
+    lv_refr_now(NULL);
+    boot_mark(BOOT_DISPLAY_READY);
+
+    if (wait_for_disk(K_SECONDS(5)) == 0) {
+        // Japanese titles come from the card, everything else from the built in font
+        const lv_font_t *font = sd_font_open(&lv_font_montserrat_12);
+        if (font) {
+            lv_obj_set_style_text_font(lv_screen_active(), font, LV_PART_MAIN);
+        }
+
+        populate_list_with_files(list);
+        lv_obj_update_layout(list);
+        prefetch_visible_rows(list);
+        lv_obj_add_event_cb(list, list_scroll_cb, LV_EVENT_SCROLL, NULL);
+    }
+    boot_mark(BOOT_LIBRARY_READY);
+
     lv_refr_now(NULL);
     k_msleep(50);
     ret = adc_channel_setup_dt(&adc_chan);
@@ -94,32 +161,43 @@ int main(void)
      
     lv_obj_t *label = lv_label_create(lv_screen_active());
     lv_obj_align(label, LV_ALIGN_CENTER, 0, 0);
+    controls_init(&pipe, label, list);
 
-    audio_thread_msg audioMessage;
+    visualizer_ui_create(lv_screen_active());
+
+    lv_obj_t *time_label = lv_label_create(lv_screen_active());
+    lv_obj_align(time_label, LV_ALIGN_BOTTOM_RIGHT, 0, 0);
+    uint32_t shown_seconds = UINT32_MAX;
+
+    lv_obj_t *title_label = lv_label_create(lv_screen_active());
+    lv_obj_set_width(title_label, 200);
+    lv_label_set_long_mode(title_label, LV_LABEL_LONG_SCROLL_CIRCULAR);
+    lv_obj_align(title_label, LV_ALIGN_BOTTOM_LEFT, 0, 0);
+    lv_label_set_text(title_label, "");
+    uint32_t shown_track = UINT32_MAX;
 
-    audioMessage.msg_type = PLAY;
-    strncpy(audioMessage.song_path, "/SD:/Ado - MIRROR.opus", sizeof(audioMessage.song_path));
-    ret = k_pipe_write(&pipe, (uint8_t *) &audioMessage, sizeof(audioMessage), K_FOREVER);
-    if (ret > 0) {
-        LOG_INF("Wrote %d bytes", ret);
-    } else if (ret != -EAGAIN) {
-        LOG_ERR("Write error %d", ret);
-    }
-    
     while(1) {
-        uint16_t volume = read_potentiometer(&adc_chan);
-        audioMessage.msg_type = VOL;
-        audioMessage.volume = volume;
-        int ret = k_pipe_write(&pipe, (uint8_t *) &audioMessage, sizeof(audioMessage), K_FOREVER);
-        if (ret > 0) {
-        } else if (ret != -EAGAIN) {
-            LOG_ERR("Write error %d", ret);
+        controls_update(read_potentiometer(&adc_chan));
+        visualizer_ui_update();
+        sd_font_poll();
+        uint32_t next_timer_ms = lv_timer_handler();
+
+        struct play_clock_snapshot position;
+        play_clock_get(&position);
+        uint32_t seconds = position.ms / 1000;
+        if (seconds != shown_seconds) {
+            shown_seconds = seconds;
+            lv_label_set_text_fmt(time_label, "%u:%02u", seconds / 60, seconds % 60);
+        }
+
+        uint32_t track = audio_now_playing();
+        if (track != shown_track && show_now_playing(title_label, track)) {
+            shown_track = track;
         }
-        lv_timer_handler();
 
-        lv_label_set_text_fmt(label, "%d", volume);
+        k_msleep(MIN(next_timer_ms, UI_PERIOD_MS));
     }
     return 0;
 }
 
-K_THREAD_DEFINE(audio_tid, 20000, audio_handler_thread, &pipe, NULL, NULL, AUDIO_THREAD_PRIO, 0, 200);
+K_THREAD_DEFINE(audio_tid, 20000, audio_handler_thread, &pipe, NULL, NULL, AUDIO_THREAD_PRIO, 0, 0);
@@ -1,36 +1,263 @@
+#include "oggparse.h"
+
+#include <string.h>
+
+#ifdef __ZEPHYR__
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 
-LOG_MODULE_REGISTER(oggparse)
-
-#define MAX_OPUS_PACKET_SIZE 2000
-#define OGG_PAGE_HEADER_SIZE 27
-
-struct ogg_parser {
-    uint8_t state;
-    uint8_t header[OGG_PAGE_HEADER_SIZE];
-    uint8_t seg_table[255];
-    size_t header_bytes;
-    size_t seg_table_bytes;
-    uint8_t nsegs;
-    uint8_t current_seg;
-    uint16_t current_seg_remaining;
-    uint8_t packet_buf[MAX_OPUS_PACKET_SIZE];
-    size_t packet_size;
-    bool headers_done;
-    uint32_t packet_count;
-};
+LOG_MODULE_REGISTER(oggparse);
+#endif
 
-enum parser_state {
-    STATE_HEADER,
-    STATE_SEGMENT_TABLE,
-    STATE_SEGMENTS
+// Nibble table for the Ogg CRC32 (poly 0x04c11db7, no reflection, init 0)
+static const uint32_t crc_nibble[16] = {
+    0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
+    0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61, 0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd
 };
 
+uint32_t ogg_crc_update(uint32_t crc, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc << 4) ^ crc_nibble[(crc >> 28) ^ (data[i] >> 4)];
+        crc = (crc << 4) ^ crc_nibble[(crc >> 28) ^ (data[i] & 0x0F)];
+    }
+    return crc;
+}
+
+int ogg_page_header_parse(const uint8_t *raw, struct ogg_page_header *hdr) {
+    if (memcmp(raw, "OggS", 4) != 0) {
+        return OGG_ERR_CAPTURE;
+    }
+    if (raw[4] != 0) {
+        return OGG_ERR_VERSION;
+    }
 
-void ogg_parser_init(struct ogg_parser *p) {
+    hdr->flags = raw[5];
+    hdr->granule = (int64_t)((uint64_t)ogg_read_le32(raw + 6) | ((uint64_t)ogg_read_le32(raw + 10) << 32));
+    hdr->serial = ogg_read_le32(raw + 14);
+    hdr->sequence = ogg_read_le32(raw + 18);
+    hdr->checksum = ogg_read_le32(raw + 22);
+    hdr->segment_count = raw[26];
+    return 0;
+}
+
+void ogg_page_header_write(uint8_t *raw, const struct ogg_page_header *hdr) {
+    memcpy(raw, "OggS", 4);
+    raw[4] = 0;
+    raw[5] = hdr->flags;
+    ogg_write_le32(raw + 6, (uint32_t)hdr->granule);
+    ogg_write_le32(raw + 10, (uint32_t)((uint64_t)hdr->granule >> 32));
+    ogg_write_le32(raw + 14, hdr->serial);
+    ogg_write_le32(raw + 18, hdr->sequence);
+    ogg_write_le32(raw + 22, hdr->checksum);
+    raw[26] = hdr->segment_count;
+}
+
+void ogg_parser_init(struct ogg_parser *p, uint8_t *packet_buf, size_t packet_cap) {
     memset(p, 0, sizeof(*p));
     p->state = STATE_HEADER;
+    p->packet_buf = packet_buf;
+    p->packet_cap = packet_cap;
+}
+
+static void start_segments(struct ogg_parser *p) {
+    p->last_complete_seg = -1;
+    for (int i = 0; i < p->nsegs; i++) {
+        if (p->seg_table[i] < 255) p->last_complete_seg = i;
+    }
+    p->current_seg = 0;
+    p->current_seg_remaining = p->seg_table[0];
+    p->state = STATE_SEGMENTS;
 }
 
+int ogg_parser_feed(struct ogg_parser *p, const uint8_t *data, size_t len, size_t *consumed) {
+    size_t pos = 0;
+    size_t n;
+    int rc;
 
+    if (p->packet_ready) {
+        p->packet_ready = false;
+        p->packet_size = 0;
+    }
+
+    while (1) {
+        switch (p->state) {
+            case STATE_HEADER:
+                if (pos == len) goto need_more;
+
+                n = OGG_PAGE_HEADER_SIZE - p->header_bytes;
+                if (n > len - pos) n = len - pos;
+                memcpy(p->header + p->header_bytes, data + pos, n);
+                p->header_bytes += n;
+                pos += n;
+                if (p->header_bytes < OGG_PAGE_HEADER_SIZE) break;
+
+                p->header_bytes = 0;
+                rc = ogg_page_header_parse(p->header, &p->page);
+                if (rc < 0) {
+                    *consumed = pos;
+                    return rc;
+                }
+
+                // A page that doesn't continue a packet drops any partial one
+                if (!(p->page.flags & OGG_FLAG_CONTINUED)) {
+                    p->packet_size = 0;
+                }
+
+                p->nsegs = p->page.segment_count;
+                p->seg_table_bytes = 0;
+                if (p->nsegs > 0) p->state = STATE_SEGMENT_TABLE;
+            break;
+            case STATE_SEGMENT_TABLE:
+                if (pos == len) goto need_more;
+
+                n = p->nsegs - p->seg_table_bytes;
+                if (n > len - pos) n = len - pos;
+                memcpy(p->seg_table + p->seg_table_bytes, data + pos, n);
+                p->seg_table_bytes += n;
+                pos += n;
+                if (p->seg_table_bytes == p->nsegs) start_segments(p);
+            break;
+            case STATE_SEGMENTS:
+                if (p->current_seg_remaining > 0) {
+                    if (pos == len) goto need_more;
+
+                    n = p->current_seg_remaining;
+                    if (n > len - pos) n = len - pos;
+                    if (p->packet_size + n > p->packet_cap) {
+                        *consumed = pos;
+                        return OGG_ERR_TOOLARGE;
+                    }
+                    memcpy(p->packet_buf + p->packet_size, data + pos, n);
+                    p->packet_size += n;
+                    p->current_seg_remaining -= n;
+                    pos += n;
+                    if (p->current_seg_remaining > 0) break;
+                }
+
+                uint8_t seg = p->current_seg++;
+                uint8_t lacing = p->seg_table[seg];
+                if (p->current_seg < p->nsegs) {
+                    p->current_seg_remaining = p->seg_table[p->current_seg];
+                } else {
+                    p->state = STATE_HEADER;
+                }
+
+                if (lacing < 255) {
+                    p->packet_last_on_page = seg == p->last_complete_seg;
+                    p->packet_eos = p->packet_last_on_page && (p->page.flags & OGG_FLAG_EOS);
+                    p->packet_count++;
+                    p->packet_ready = true;
+                    *consumed = pos;
+                    return OGG_PACKET;
+                }
+            break;
+        }
+    }
+
+need_more:
+    *consumed = pos;
+    return OGG_NEED_MORE;
+}
+
+int opus_head_parse(const uint8_t *buf, size_t len, struct opus_head *head) {
+    if (len < OPUS_HEAD_MIN_SIZE || memcmp(buf, "OpusHead", 8) != 0) {
+        return -1;
+    }
+
+    head->version = buf[8];
+    head->channels = buf[9];
+    head->pre_skip = (uint16_t)buf[10] | ((uint16_t)buf[11] << 8);
+    head->input_sample_rate = ogg_read_le32(buf + 12);
+    head->output_gain = (int16_t)((uint16_t)buf[16] | ((uint16_t)buf[17] << 8));
+    head->mapping_family = buf[18];
+
+    // Major version 0 is the only one defined
+    if ((head->version & 0xF0) != 0 || head->channels == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Samples per channel at 48kHz for an Opus packet, from its TOC byte (RFC 6716 3.1)
+int opus_toc_samples(const uint8_t *packet, size_t len) {
+    if (len < 1) return -1;
+
+    uint8_t toc = packet[0];
+    int config = toc >> 3;
+    int frame_samples;
+
+    if (toc & 0x80) {
+        // CELT only, 2.5/5/10/20ms
+        frame_samples = (48000 << (config & 3)) / 400;
+    } else if ((toc & 0x60) == 0x60) {
+        // Hybrid, 10/20ms
+        frame_samples = (config & 1) ? 960 : 480;
+    } else {
+        // SILK only, 10/20/40/60ms
+        frame_samples = (config & 3) == 3 ? 2880 : (48000 << (config & 3)) / 100;
+    }
+
+    int frames;
+    switch (toc & 3) {
+        case 0:
+            frames = 1;
+        break;
+        case 1:
+        case 2:
+            frames = 2;
+        break;
+        default:
+            if (len < 2) return -1;
+            frames = packet[1] & 0x3F;
+        break;
+    }
+
+    int samples = frames * frame_samples;
+    if (samples == 0 || samples > OPUS_MAX_FRAME_SAMPLES) return -1;
+    return samples;
+}
+
+int opus_tags_iter_init(struct opus_tags_iter *it, const uint8_t *buf, size_t len,
+                        const uint8_t **vendor, uint32_t *vendor_len) {
+    if (len < 16 || memcmp(buf, "OpusTags", 8) != 0) {
+        return -1;
+    }
+
+    uint32_t vlen = ogg_read_le32(buf + 8);
+    if (vlen > len - 16) {
+        return -1;
+    }
+
+    if (vendor) *vendor = buf + 12;
+    if (vendor_len) *vendor_len = vlen;
+
+    it->data = buf;
+    it->size = len;
+    it->pos = 12 + vlen + 4;
+    it->remaining = ogg_read_le32(buf + 12 + vlen);
+    return 0;
+}
+
+bool opus_tags_iter_next(struct opus_tags_iter *it, const uint8_t **comment, uint32_t *comment_len) {
+    if (it->remaining == 0 || it->size - it->pos < 4) {
+        it->remaining = 0;
+        return false;
+    }
+
+    uint32_t clen = ogg_read_le32(it->data + it->pos);
+    if (clen > it->size - it->pos - 4) {
+        it->remaining = 0;
+        return false;
+    }
+
+    *comment = it->data + it->pos + 4;
+    *comment_len = clen;
+    it->pos += 4 + clen;
+    it->remaining--;
+    return true;
+}
+
+size_t opus_tags_trailer(const struct opus_tags_iter *it, const uint8_t **trailer) {
+    *trailer = it->data + it->pos;
+    return it->size - it->pos;
+}
@@ -1,4 +1,6 @@
 #include "opus_file.h"
+#include "oggparse.h"
+#include "card_layout.h"
 #include "zephyr/kernel.h"
 #include "zephyr/logging/log_core.h"
 
@@ -7,7 +9,14 @@
 LOG_MODULE_REGISTER(opus_file, LOG_LEVEL_DBG);
 
 static uint8_t ogg_header[OGG_HEADER_SIZE];
-uint16_t opus_verify_header(struct fs_file_t* fp, opus_state_t *state) {
+// Window onto OpusTags, long comments are logged truncated
+static uint8_t tag_buf[64];
+
+static int read_exact(struct fs_file_t *fp, void *buf, size_t len) {
+    return fs_read(fp, buf, len) == (ssize_t) len ? 0 : OP_MISS;
+}
+
+int opus_verify_header(struct fs_file_t* fp, opus_state_t *state) {
     size_t rd = fs_read(fp, ogg_header, OGG_HEADER_SIZE);
     if (rd != OGG_HEADER_SIZE) {
         LOG_ERR("OGG header size read did not match: got %d : expected %d", (int) rd, OGG_HEADER_SIZE);
@@ -41,15 +50,19 @@ uint16_t opus_verify_header(struct fs_file_t* fp, opus_state_t *state) {
         return OP_NOOPUS;
     }
 
-    LOG_DBG("Stream version: %d", opus_head[8]);
+    struct opus_head head;
+    if (opus_head_parse(opus_head, OPUS_HEAD_SIZE, &head) < 0) {
+        LOG_ERR("Unsupported OpusHead");
+        return OP_NOOPUS;
+    }
 
-    LOG_DBG("Channel count: %d", opus_head[9]);
-    uint16_t discard_samples = ((uint16_t) opus_head[10]) | ((uint16_t)opus_head[11] << 8);
+    LOG_DBG("Stream version: %d", head.version);
+    LOG_DBG("Channel count: %d", head.channels);
+    uint16_t discard_samples = head.pre_skip;
+    state->pre_skip = head.pre_skip;
     LOG_DBG("Discard samples: %d", discard_samples);
-    uint32_t sample_rate = ((uint32_t) opus_head[12]) | ((uint32_t) opus_head[13] << 8) | ((uint32_t) opus_head[14] << 16) | ((uint32_t) opus_head[15] << 24);
-    LOG_DBG("Sample rate: %d", sample_rate);
-    uint16_t output_gain = ((uint16_t) opus_head[16]) | ((uint16_t) opus_head[17] << 8);
-    LOG_DBG("Output gain: %d", output_gain);
+    LOG_DBG("Sample rate: %d", head.input_sample_rate);
+    LOG_DBG("Output gain: %d", head.output_gain);
     
     rd = fs_read(fp, ogg_header, OGG_HEADER_SIZE);
     if (rd != OGG_HEADER_SIZE) {
@@ -71,48 +84,71 @@ uint16_t opus_verify_header(struct fs_file_t* fp, opus_state_t *state) {
         return OP_MISS;
     }
     
-    uint16_t opus_tags_size = 0;
+    uint32_t opus_tags_size = 0;
     for (uint8_t i = 0; i < segment_num; i++) {
         opus_tags_size += (uint8_t) segment_table[i];
     }
 
-    
-    char opus_tags[opus_tags_size];
-    rd = fs_read(fp, opus_tags, (uint16_t) opus_tags_size);
-    if (rd != opus_tags_size) {
-        LOG_ERR("Did not read enough segment lengths for opusTags");
-        return OP_MISS;
-    }
+    // OpusTags can carry tens of KiB of cover art, it's walked on the card
+    // in small reads rather than copied onto the audio thread's stack
+    off_t tags_offset = fs_tell(fp);
+    off_t tags_end = tags_offset + opus_tags_size;
+    state->audio_offset = tags_end;
 
-
-    if(memcmp("OpusTags", opus_tags, 8) != 0) {
+    if (opus_tags_size < 16 || read_exact(fp, tag_buf, 12) < 0 || memcmp(tag_buf, "OpusTags", 8) != 0) {
         LOG_ERR("OpusTags does not exist");
         return OP_NOTAGS;
     }
-    
-    uint32_t vendor_len = ((uint32_t) opus_tags[8]) | ((uint32_t) opus_tags[9] << 8) | ((uint32_t) opus_tags[10] << 16) | ((uint32_t) opus_tags[11] << 24);
-    LOG_DBG("%.*s", vendor_len, opus_tags + 12);
+    uint32_t vendor_len = ogg_read_le32(tag_buf + 8);
+    if (vendor_len > opus_tags_size - 16) {
+        LOG_ERR("OpusTags does not exist");
+        return OP_NOTAGS;
+    }
+    size_t shown = MIN(vendor_len, sizeof(tag_buf));
+    if (read_exact(fp, tag_buf, shown) < 0) return OP_MISS;
+    LOG_DBG("%.*s", (int) shown, tag_buf);
+
+    off_t pos = tags_offset + 12 + vendor_len;
+    fs_seek(fp, pos, FS_SEEK_SET);
+    if (read_exact(fp, tag_buf, 4) < 0) return OP_MISS;
+    uint32_t comment_count = ogg_read_le32(tag_buf);
+    pos += 4;
+    LOG_DBG("User comment count: %"PRIu32"", comment_count);
+
+    // Same bounds as opus_tags_iter_next, a bad length ends the list
+    LOG_DBG("User tags: ");
+    for (uint32_t i = 0; i < comment_count && tags_end - pos >= 4; i++) {
+        if (read_exact(fp, tag_buf, 4) < 0) return OP_MISS;
+        uint32_t comment_len = ogg_read_le32(tag_buf);
+        if (comment_len > (uint32_t) (tags_end - pos - 4)) break;
 
-    uint32_t new_ptr = 12 + vendor_len;
+        shown = MIN(comment_len, sizeof(tag_buf));
+        if (read_exact(fp, tag_buf, shown) < 0) return OP_MISS;
+        LOG_DBG("%.*s", (int) shown, tag_buf);
 
-    uint32_t user_comment_count =((uint32_t) opus_tags[new_ptr]) | ((uint32_t) opus_tags[new_ptr + 1] << 8) | ((uint32_t) opus_tags[new_ptr + 2] << 16) | ((uint32_t) opus_tags[new_ptr + 3] << 24); 
-    LOG_DBG("User comment count: %"PRIu32"", (uint32_t) user_comment_count);
+        pos += 4 + comment_len;
+        fs_seek(fp, pos, FS_SEEK_SET);
+    }
 
-    new_ptr += 4;
-    
-    LOG_DBG("User tags: ");
-    for (uint32_t i = 0; i < user_comment_count; i++) {
-        uint32_t comment_len = ((uint32_t) opus_tags[new_ptr]) | ((uint32_t) opus_tags[new_ptr + 1] << 8) | ((uint32_t) opus_tags[new_ptr + 2] << 16) | ((uint32_t) opus_tags[new_ptr + 3] << 24);
-        new_ptr += 4;
-        LOG_DBG("%.*s", comment_len, opus_tags + new_ptr);
-        new_ptr += comment_len;
+    // pos is now the binary trailer, where cardprep puts the seek table
+    struct seek_table_header seek;
+    if (tags_end - pos >= (off_t) sizeof(seek) && read_exact(fp, &seek, sizeof(seek)) == 0 &&
+        memcmp(seek.magic, SEEK_TABLE_MAGIC, SEEK_TABLE_MAGIC_LEN) == 0) {
+        size_t table_size = (size_t) seek.count * sizeof(struct seek_table_entry);
+        if (seek.version == SEEK_TABLE_VERSION && table_size <= (size_t) (tags_end - pos) - sizeof(seek)) {
+            state->seek_table_offset = pos + sizeof(seek);
+            state->seek_entries = seek.count;
+            LOG_DBG("Seek table: %d entries", seek.count);
+        }
     }
 
+    fs_seek(fp, tags_end, FS_SEEK_SET);
     return discard_samples;
 }
 
 void opus_state_init(opus_state_t *st) {
     memset(st, 0, sizeof(opus_state_t));
+    st->packet_granule = -1;
 }
 
 static int _opus_open_page(opus_state_t *st, struct fs_file_t *fp) {
@@ -123,14 +159,14 @@ static int _opus_open_page(opus_state_t *st, struct fs_file_t *fp) {
         return OP_MISS;
     }
 
-    if (memcmp("OggS", ogg_header, 4) != 0) {
+    struct ogg_page_header page;
+    if (ogg_page_header_parse(ogg_header, &page) < 0) {
         LOG_ERR("Next segment is not OggS stream");
         return OP_NOOGG;
     }
-    uint8_t segment_count = ogg_header[26];
+    uint8_t segment_count = page.segment_count;
 
-    uint8_t header_type = ogg_header[5];
-    st->is_eos_page = (header_type & 0x04) != 0;
+    st->is_eos_page = (page.flags & OGG_FLAG_EOS) != 0;
     if (st->is_eos_page) {
         LOG_DBG("Reached last stream page");
     }
@@ -138,6 +174,7 @@ static int _opus_open_page(opus_state_t *st, struct fs_file_t *fp) {
     st->remaining_segments = segment_count;
     st->page_segment_count = segment_count;
     st->segment_pos = 0;
+    st->page_granule = page.granule;
 
     rd = fs_read(fp, st->segment_lengths, segment_count);
     if (rd != segment_count) {
@@ -145,6 +182,12 @@ static int _opus_open_page(opus_state_t *st, struct fs_file_t *fp) {
         return OP_MISS;
     }
 
+    // The page granule belongs to the last packet that completes on it
+    st->last_complete_segment = -1;
+    for (int i = 0; i < segment_count; i++) {
+        if (st->segment_lengths[i] < 255) st->last_complete_segment = i;
+    }
+
     return OP_OK;
 }
 
@@ -160,6 +203,7 @@ int opus_get_packet(opus_state_t *st, uint8_t *buff, uint16_t *pack_size, struct
     }
     
     uint16_t opus_len = 0;
+    int16_t end_segment = 0;
     while(1) {
         if (st->remaining_segments == 0) {
             LOG_DBG("Page wrap occured");
@@ -168,6 +212,7 @@ int opus_get_packet(opus_state_t *st, uint8_t *buff, uint16_t *pack_size, struct
         }
 
         uint8_t seg = st->segment_lengths[st->segment_pos];
+        end_segment = st->segment_pos;
         opus_len += seg;
 
         st->remaining_segments -= 1;
@@ -180,6 +225,8 @@ int opus_get_packet(opus_state_t *st, uint8_t *buff, uint16_t *pack_size, struct
         if (seg < 255) break;
     } 
 
+    st->packet_granule = end_segment == st->last_complete_segment ? st->page_granule : -1;
+
     if (opus_len == 0) {
         LOG_ERR("Opus packet length 0");
         return OP_ZERO;
@@ -205,3 +252,167 @@ int opus_get_packet(opus_state_t *st, uint8_t *buff, uint16_t *pack_size, struct
     return OP_OK;
 }
 
+static int _opus_read_seek_entry(opus_state_t *st, struct fs_file_t *fp, uint16_t idx,
+                                 struct seek_table_entry *entry) {
+    fs_seek(fp, st->seek_table_offset + (off_t) idx * sizeof(*entry), FS_SEEK_SET);
+    if (fs_read(fp, entry, sizeof(*entry)) != sizeof(*entry)) {
+        LOG_ERR("Failed to read seek entry %d", idx);
+        return OP_MISS;
+    }
+    return OP_OK;
+}
+
+// Bisection narrows to this many bytes, the rest is walked page by page
+#define SEEK_BISECT_MIN 4096
+
+static uint8_t scan_buf[128];
+static uint8_t scan_segments[OGG_MAX_SEGMENTS];
+
+// Finds the first page of the stream starting at or after offset and before
+// end that ends a packet. Sets its offset, its granule and the offset just
+// past it.
+static int _opus_next_page(struct fs_file_t *fp, uint32_t serial, off_t offset, off_t end,
+                           off_t *page_offset, int64_t *granule, off_t *next) {
+    while (offset < end) {
+        fs_seek(fp, offset, FS_SEEK_SET);
+        ssize_t rd = fs_read(fp, scan_buf, sizeof(scan_buf));
+        if (rd < OGG_HEADER_SIZE) return OP_EOF;
+
+        ssize_t i = 0;
+        while (i + 4 <= rd && memcmp(scan_buf + i, "OggS", 4) != 0) i++;
+        if (i + OGG_HEADER_SIZE > rd) {
+            // No capture pattern, or one whose header runs past the buffer
+            offset += i + 4 <= rd ? i : rd - 3;
+            continue;
+        }
+
+        // Packet data can contain the capture pattern too
+        struct ogg_page_header page;
+        if (ogg_page_header_parse(scan_buf + i, &page) < 0 || page.serial != serial) {
+            offset += i + 1;
+            continue;
+        }
+
+        off_t at = offset + i;
+        fs_seek(fp, at + OGG_HEADER_SIZE, FS_SEEK_SET);
+        if (fs_read(fp, scan_segments, page.segment_count) != page.segment_count) return OP_MISS;
+        off_t size = OGG_HEADER_SIZE + page.segment_count;
+        for (int i = 0; i < page.segment_count; i++) size += scan_segments[i];
+
+        // No packet ends on it, the granule is -1
+        if (page.granule < 0) {
+            offset = at + size;
+            continue;
+        }
+        *page_offset = at;
+        *granule = page.granule;
+        *next = at + size;
+        return OP_OK;
+    }
+    return OP_EOF;
+}
+// Without a seek table, bisects the file on page granules for the last page
+// whose first sample is at or before granule, as RFC 7845 section 6 suggests
+static int _opus_bisect(opus_state_t *st, struct fs_file_t *fp, int64_t granule,
+                        off_t *found, int64_t *found_start) {
+    if (fs_seek(fp, 0, FS_SEEK_END) < 0) return OP_MISS;
+    off_t end = fs_tell(fp);
+
+    fs_seek(fp, st->audio_offset, FS_SEEK_SET);
+    struct ogg_page_header first;
+    if (fs_read(fp, scan_buf, OGG_HEADER_SIZE) != OGG_HEADER_SIZE ||
+        ogg_page_header_parse(scan_buf, &first) < 0) {
+        return OP_NOOGG;
+    }
+
+    // lo is always a page start and lo_granule the last sample before it
+    off_t lo = st->audio_offset;
+    int64_t lo_granule = 0;
+    off_t hi = end;
+    off_t page, next;
+    int64_t page_granule;
+
+    while (hi - lo > SEEK_BISECT_MIN) {
+        off_t mid = lo + (hi - lo) / 2;
+        int res = _opus_next_page(fp, first.serial, mid, hi, &page, &page_granule, &next);
+        if (res == OP_OK && page_granule <= granule) {
+            lo = next;
+            lo_granule = page_granule;
+        } else if (res == OP_OK || res == OP_EOF) {
+            hi = mid;
+        } else {
+            return res;
+        }
+    }
+
+    // Walk the last stretch, the page to decode from is the one after the last
+    // page ending at or before granule
+    while (_opus_next_page(fp, first.serial, lo, end, &page, &page_granule, &next) == OP_OK &&
+           page_granule <= granule) {
+        lo = next;
+        lo_granule = page_granule;
+    }
+    if (lo >= end) return OP_EOF;
+
+    *found = lo;
+    *found_start = lo_granule;
+    return OP_OK;
+}
+
+// Positions the file on the last indexed page starting at or before granule,
+// or the last such page found by bisection if the file has no seek table.
+// page_start is set to the granule of the first sample on that page. On
+// failure the file is left where it was.
+int opus_seek(opus_state_t *st, struct fs_file_t *fp, int64_t granule, int64_t *page_start) {
+    if (st->seek_entries == 0) {
+        // Not prepared by cardprep. Like opus_get_packet this expects packets
+        // not to span pages, so decoding starts at the top of the page found.
+        off_t here = fs_tell(fp);
+        off_t found = 0;
+        int res = _opus_bisect(st, fp, granule, &found, page_start);
+        if (res < 0) {
+            LOG_ERR("Seek to %d ms failed: %d", (int) (granule / 48), res);
+            fs_seek(fp, here, FS_SEEK_SET);
+            return res;
+        }
+        fs_seek(fp, found, FS_SEEK_SET);
+        st->remaining_segments = 0;
+        st->segment_pos = 0;
+        st->is_eos_page = false;
+        st->packet_granule = -1;
+        return OP_OK;
+    }
+
+    struct seek_table_entry entry;
+    uint16_t lo = 0;
+    uint16_t hi = st->seek_entries - 1;
+    off_t here = fs_tell(fp);
+    while (lo < hi) {
+        uint16_t mid = (lo + hi + 1) / 2;
+        int res = _opus_read_seek_entry(st, fp, mid, &entry);
+        if (res < 0) {
+            fs_seek(fp, here, FS_SEEK_SET);
+            return res;
+        }
+
+        if (entry.granule <= granule) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    int res = _opus_read_seek_entry(st, fp, lo, &entry);
+    if (res < 0) {
+        fs_seek(fp, here, FS_SEEK_SET);
+        return res;
+    }
+
+    fs_seek(fp, st->audio_offset + entry.offset, FS_SEEK_SET);
+    st->remaining_segments = 0;
+    st->segment_pos = 0;
+    st->is_eos_page = false;
+    st->packet_granule = -1;
+    *page_start = entry.granule;
+    return OP_OK;
+}
@@ -0,0 +1,134 @@
+#include "play_clock.h"
+#include "audio_playback.h"
+#include "latency_probe.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(play_clock, LOG_LEVEL_DBG);
+
+// End positions of the blocks handed to the DMA, oldest first. Only touched
+// by the audio thread.
+static int64_t queued[PLAY_CLOCK_MAX_BLOCKS];
+static uint32_t queue_head;
+static uint32_t queue_len;
+
+#define PLAY_CLOCK_LATENCY_BOUND_US LATENCY_BOUND_US(BLOCK_US)
+
+static struct latency_probe probe = {.response_ahead = -1};
+
+// Published state, double buffered. Publish n fills slots[n & 1] and then
+// sets clock_seq to n, so the slot a reader copies is only rewritten two
+// publishes later and the reader never has to wait for the writer.
+static struct play_clock_snapshot staging;
+static struct play_clock_snapshot slots[2];
+static atomic_t clock_seq;
+
+static void commit(void) {
+    atomic_val_t next = atomic_get(&clock_seq) + 1;
+    slots[next & 1] = staging;
+    atomic_set(&clock_seq, next);
+}
+
+static void publish(uint64_t samples) {
+    staging.samples = samples;
+    staging.ms = (uint32_t)(samples * 1000 / SAMPLE_RATE);
+    commit();
+}
+
+void play_clock_reset(void) {
+    queue_head = 0;
+    queue_len = 0;
+    latency_probe_cancel(&probe);
+
+    staging.samples = 0;
+    staging.ms = 0;
+    staging.paused = false;
+    commit();
+}
+
+void play_clock_queue(int64_t end_position) {
+    if (queue_len == PLAY_CLOCK_MAX_BLOCKS) {
+        LOG_ERR("Play clock queue overflow");
+        return;
+    }
+    queued[(queue_head + queue_len) % PLAY_CLOCK_MAX_BLOCKS] = end_position < 0 ? 0 : end_position;
+    queue_len++;
+}
+
+static int64_t now_us(void) {
+    return (int64_t) k_ticks_to_us_ceil64(k_uptime_ticks());
+}
+
+static void response_audible(uint32_t latency_us) {
+    if (latency_us == probe.worst_us) {
+        LOG_INF("Transport latency %u us (new worst)", latency_us);
+    }
+    if (latency_us > PLAY_CLOCK_LATENCY_BOUND_US) {
+        LOG_WRN("Transport latency %u us over %u us bound", latency_us, PLAY_CLOCK_LATENCY_BOUND_US);
+    }
+    __ASSERT(latency_us <= PLAY_CLOCK_LATENCY_BOUND_US, "transport latency %u us", latency_us);
+}
+
+// Every block beyond what the DMA still owns has finished playing
+void play_clock_sync(uint32_t in_flight) {
+    while (queue_len > in_flight) {
+        int64_t end = queued[queue_head];
+        queue_head = (queue_head + 1) % PLAY_CLOCK_MAX_BLOCKS;
+        queue_len--;
+
+        if (queue_len == in_flight) {
+            publish(end);
+        }
+
+        uint32_t latency_us;
+        if (latency_probe_block_played(&probe, now_us(), &latency_us)) {
+            response_audible(latency_us);
+        }
+    }
+}
+
+void play_clock_cut(void) {
+    for (uint32_t i = 0; i < queue_len; i++) {
+        queued[(queue_head + i) % PLAY_CLOCK_MAX_BLOCKS] = 0;
+    }
+    publish(0);
+}
+
+void play_clock_mark_command(int64_t sent_ticks) {
+    latency_probe_command(&probe, (int64_t) k_ticks_to_us_floor64(sent_ticks));
+}
+
+void play_clock_mark_response(void) {
+    uint32_t latency_us;
+    if (latency_probe_response(&probe, queue_len - 1, now_us(), &latency_us)) {
+        response_audible(latency_us);
+    }
+}
+
+uint32_t play_clock_worst_latency_us(void) {
+    return probe.worst_us;
+}
+
+void play_clock_set_active(bool active) {
+    staging.active = active;
+    commit();
+}
+
+void play_clock_set_paused(bool paused) {
+    staging.paused = paused;
+    commit();
+}
+
+// A retry copies the slot the writer just finished, so a writer stalled
+// part way through filling the other one can't hold the reader up
+void play_clock_get(struct play_clock_snapshot *out) {
+    atomic_val_t seq = atomic_get(&clock_seq);
+    while (1) {
+        *out = slots[seq & 1];
+        atomic_val_t now = atomic_get(&clock_seq);
+        if (now == seq) return;
+        seq = now;
+    }
+}
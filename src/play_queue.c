@@ -0,0 +1,130 @@
+#include "play_queue.h"
+
+#include <string.h>
+
+static uint32_t mix(uint32_t x, uint32_t key) {
+    x ^= key;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t feistel(const struct play_queue *q, uint32_t x, bool inverse) {
+    uint32_t mask = (1u << q->half_bits) - 1;
+    uint32_t left = x >> q->half_bits;
+    uint32_t right = x & mask;
+
+    for (int i = 0; i < PLAY_QUEUE_ROUNDS; i++) {
+        if (inverse) {
+            uint32_t prev_right = left;
+            left = right ^ (mix(left, q->keys[PLAY_QUEUE_ROUNDS - 1 - i]) & mask);
+            right = prev_right;
+        } else {
+            uint32_t next_left = right;
+            right = left ^ (mix(right, q->keys[i]) & mask);
+            left = next_left;
+        }
+    }
+    return (left << q->half_bits) | right;
+}
+
+// Cycle walking keeps the permutation inside [0, count), the domain is at
+// most 4x count so this takes a few rounds on average
+static uint32_t permute(const struct play_queue *q, uint32_t pos, bool inverse) {
+    if (!q->shuffle) return pos;
+
+    uint32_t x = pos;
+    do {
+        x = feistel(q, x, inverse);
+    } while (x >= q->count);
+    return x;
+}
+
+static uint32_t slot(const struct play_queue *q, uint32_t pos) {
+    uint32_t slot = q->start + pos;
+    return slot >= q->count || slot < q->start ? slot - q->count : slot;
+}
+
+static void derive_keys(struct play_queue *q) {
+    uint32_t k = q->seed;
+    for (int i = 0; i < PLAY_QUEUE_ROUNDS; i++) {
+        k = mix(k + 0x9e3779b9, 0x5bd1e995 + i);
+        q->keys[i] = k;
+    }
+}
+
+void play_queue_init(struct play_queue *q, uint32_t count) {
+    memset(q, 0, sizeof(*q));
+    q->count = count;
+
+    uint8_t bits = 0;
+    while (bits < 32 && (1ull << bits) < count) bits++;
+    q->half_bits = (bits + 1) / 2;
+    if (q->half_bits == 0) q->half_bits = 1;
+}
+
+void play_queue_set_shuffle(struct play_queue *q, bool shuffle, uint32_t seed) {
+    uint32_t current = play_queue_current(q);
+
+    q->shuffle = shuffle;
+    q->seed = seed;
+    derive_keys(q);
+
+    // A new cycle starts at the current track
+    q->pos = 0;
+    q->start = q->count ? permute(q, current, true) : 0;
+}
+
+uint32_t play_queue_current(const struct play_queue *q) {
+    if (q->count == 0) return 0;
+    return permute(q, slot(q, q->pos), false);
+}
+
+void play_queue_jump(struct play_queue *q, uint32_t id) {
+    if (id >= q->count) return;
+
+    uint32_t target = permute(q, id, true);
+    q->pos = target >= q->start ? target - q->start : target + (q->count - q->start);
+}
+
+bool play_queue_next(struct play_queue *q, uint32_t *id) {
+    if (q->count == 0) return false;
+
+    if (++q->pos == q->count) {
+        q->pos = 0;
+        if (q->shuffle) {
+            q->seed++;
+            derive_keys(q);
+        }
+    }
+    *id = play_queue_current(q);
+    return true;
+}
+
+bool play_queue_prev(struct play_queue *q, uint32_t *id) {
+    if (q->count == 0 || q->pos == 0) return false;
+
+    q->pos--;
+    *id = play_queue_current(q);
+    return true;
+}
+
+bool play_queue_peek(const struct play_queue *q, uint32_t offset, uint32_t *id) {
+    if (q->count == 0 || offset >= q->count) return false;
+
+    // Past the wrap the order comes from the next seed
+    struct play_queue ahead = *q;
+    if (ahead.pos + offset >= ahead.count) {
+        ahead.pos = ahead.pos + offset - ahead.count;
+        if (ahead.shuffle) {
+            ahead.seed++;
+            derive_keys(&ahead);
+        }
+    } else {
+        ahead.pos += offset;
+    }
+    *id = play_queue_current(&ahead);
+    return true;
+}
@@ -0,0 +1,83 @@
+#include "resume_state.h"
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(resume_state, LOG_LEVEL_DBG);
+
+static struct resume_state pending;
+static struct k_spinlock pending_lock;
+
+static void save_handler(struct k_work *work);
+K_WORK_DEFINE(save_work, save_handler);
+
+static uint32_t checksum(const struct resume_state *st) {
+    const uint8_t *p = (const uint8_t *) st;
+    uint32_t sum = 0x811C9DC5;
+    for (size_t i = 0; i < offsetof(struct resume_state, checksum); i++) {
+        sum = (sum ^ p[i]) * 0x01000193;
+    }
+    return sum;
+}
+
+int resume_state_load(struct resume_state *out) {
+    struct fs_file_t file;
+    fs_file_t_init(&file);
+
+    int rc = fs_open(&file, RESUME_STATE_PATH, FS_O_READ);
+    if (rc < 0) {
+        LOG_INF("No resume state: %d", rc);
+        return rc;
+    }
+
+    ssize_t rd = fs_read(&file, out, sizeof(*out));
+    fs_close(&file);
+
+    if (rd != sizeof(*out) || out->magic != RESUME_STATE_MAGIC || out->checksum != checksum(out)) {
+        LOG_ERR("Resume state is corrupt");
+        return -EINVAL;
+    }
+    LOG_INF("Resuming track %u at %u ms", play_queue_current(&out->queue), out->position_ms);
+    return 0;
+}
+
+static void save_handler(struct k_work *work) {
+    struct resume_state st;
+
+    k_spinlock_key_t key = k_spin_lock(&pending_lock);
+    st = pending;
+    k_spin_unlock(&pending_lock, key);
+
+    struct fs_file_t file;
+    fs_file_t_init(&file);
+
+    int rc = fs_open(&file, RESUME_STATE_PATH, FS_O_CREATE | FS_O_WRITE);
+    if (rc < 0) {
+        LOG_ERR("Failed to open resume state: %d", rc);
+        return;
+    }
+
+    ssize_t wr = fs_write(&file, &st, sizeof(st));
+    if (wr != sizeof(st)) {
+        LOG_ERR("Failed to write resume state: %d", (int) wr);
+    }
+    fs_close(&file);
+}
+
+void resume_state_save(const struct play_queue *queue, uint32_t position_ms) {
+    struct resume_state st;
+    // Padding is covered by the checksum, keep it zeroed
+    memset(&st, 0, sizeof(st));
+    st.magic = RESUME_STATE_MAGIC;
+    memcpy(&st.queue, queue, sizeof(st.queue));
+    st.position_ms = position_ms;
+    st.checksum = checksum(&st);
+
+    k_spinlock_key_t key = k_spin_lock(&pending_lock);
+    pending = st;
+    k_spin_unlock(&pending_lock, key);
+
+    k_work_submit(&save_work);
+}
@@ -0,0 +1,368 @@
+#include "sd_font.h"
+#include "collate.h"
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(sd_font, LOG_LEVEL_DBG);
+
+#define FONT_THREAD_PRIO 9
+
+enum slot_state {SLOT_FREE, SLOT_PENDING, SLOT_LOADED, SLOT_MISSING};
+
+struct glyph_slot {
+    uint32_t codepoint;
+    int16_t hash_next;
+    int16_t lru_prev;
+    int16_t lru_next;
+    uint8_t state;
+    bool drawn_blank;
+    // Frame the glyph was last laid out in, it can't be evicted during it
+    uint32_t used_frame;
+    uint8_t adv_w;
+    uint8_t box_w;
+    uint8_t box_h;
+    int8_t ofs_x;
+    int8_t ofs_y;
+    uint8_t bitmap[FONT_MAX_GLYPH_BYTES];
+};
+
+static struct font_file_header header;
+static uint32_t page_first[SD_FONT_MAX_PAGES];
+static uint32_t page_count;
+static struct fs_file_t font_file;
+static lv_font_t sd_font;
+static bool font_open;
+
+// Cache, shared by the LVGL thread and the loader. Every slot is on the LRU
+// list, most recently used at the head, free slots collect at the tail.
+static struct glyph_slot slots[SD_FONT_CACHE_GLYPHS];
+static int16_t buckets[SD_FONT_HASH_BUCKETS];
+static int16_t lru_head;
+static int16_t lru_tail;
+static struct k_spinlock cache_lock;
+
+static atomic_t redraw_needed;
+// Counts passes of the UI loop, see sd_font_poll. Only the LVGL thread uses it.
+static uint32_t frame = 1;
+
+K_MSGQ_DEFINE(request_queue, sizeof(uint32_t), SD_FONT_QUEUE_LEN, 4);
+
+static uint32_t bucket_of(uint32_t codepoint) {
+    return ((codepoint * 0x9e3779b1) >> 16) & (SD_FONT_HASH_BUCKETS - 1);
+}
+
+static struct glyph_slot *find_slot(uint32_t codepoint) {
+    for (int16_t i = buckets[bucket_of(codepoint)]; i >= 0; i = slots[i].hash_next) {
+        if (slots[i].codepoint == codepoint) return &slots[i];
+    }
+    return NULL;
+}
+
+static void lru_unlink(int16_t i) {
+    if (slots[i].lru_prev >= 0) slots[slots[i].lru_prev].lru_next = slots[i].lru_next;
+    else lru_head = slots[i].lru_next;
+    if (slots[i].lru_next >= 0) slots[slots[i].lru_next].lru_prev = slots[i].lru_prev;
+    else lru_tail = slots[i].lru_prev;
+}
+
+static void touch(struct glyph_slot *slot) {
+    int16_t i = slot - slots;
+    if (i == lru_head) return;
+
+    lru_unlink(i);
+    slot->lru_prev = -1;
+    slot->lru_next = lru_head;
+    slots[lru_head].lru_prev = i;
+    lru_head = i;
+}
+
+static void hash_remove(struct glyph_slot *slot) {
+    int16_t *link = &buckets[bucket_of(slot->codepoint)];
+    while (*link >= 0) {
+        if (&slots[*link] == slot) {
+            *link = slot->hash_next;
+            return;
+        }
+        link = &slots[*link].hash_next;
+    }
+}
+
+// Takes over the least recently used slot for a glyph that is about to be
+// loaded. Glyphs laid out in the current frame are skipped so their bitmaps
+// are still there when LVGL draws them, NULL if every slot is in use.
+static struct glyph_slot *claim_slot(uint32_t codepoint) {
+    int16_t i = lru_tail;
+    while (i >= 0 && slots[i].used_frame == frame) i = slots[i].lru_prev;
+    if (i < 0) return NULL;
+
+    struct glyph_slot *slot = &slots[i];
+    if (slot->state != SLOT_FREE) hash_remove(slot);
+
+    uint32_t b = bucket_of(codepoint);
+    slot->codepoint = codepoint;
+    slot->state = SLOT_PENDING;
+    slot->drawn_blank = false;
+    slot->hash_next = buckets[b];
+    buckets[b] = slot - slots;
+    touch(slot);
+    return slot;
+}
+
+static void cache_init(void) {
+    for (int i = 0; i < SD_FONT_HASH_BUCKETS; i++) buckets[i] = -1;
+    for (int i = 0; i < SD_FONT_CACHE_GLYPHS; i++) {
+        slots[i].state = SLOT_FREE;
+        slots[i].hash_next = -1;
+        slots[i].used_frame = 0;
+        slots[i].lru_prev = i - 1;
+        slots[i].lru_next = i + 1 < SD_FONT_CACHE_GLYPHS ? i + 1 : -1;
+    }
+    lru_head = 0;
+    lru_tail = SD_FONT_CACHE_GLYPHS - 1;
+}
+
+static void release_slot(uint32_t codepoint) {
+    k_spinlock_key_t key = k_spin_lock(&cache_lock);
+    struct glyph_slot *slot = find_slot(codepoint);
+    if (slot && slot->state == SLOT_PENDING) {
+        hash_remove(slot);
+        slot->state = SLOT_FREE;
+    }
+    k_spin_unlock(&cache_lock, key);
+}
+
+// Hands a claimed slot to the loader, it is given back if the queue is full
+// so the next draw retries
+static void request(uint32_t codepoint) {
+    if (k_msgq_put(&request_queue, &codepoint, K_NO_WAIT) < 0) {
+        release_slot(codepoint);
+    }
+}
+
+static bool in_font_range(uint32_t codepoint) {
+    return page_count > 0 && codepoint >= page_first[0];
+}
+
+static bool get_glyph_dsc(const lv_font_t *font, lv_font_glyph_dsc_t *dsc, uint32_t letter, uint32_t letter_next) {
+    if (!in_font_range(letter)) return false;
+
+    bool queue = false;
+    k_spinlock_key_t key = k_spin_lock(&cache_lock);
+    struct glyph_slot *slot = find_slot(letter);
+    if (slot) {
+        touch(slot);
+    } else {
+        slot = claim_slot(letter);
+        queue = slot != NULL;
+    }
+    if (slot) slot->used_frame = frame;
+
+    // More glyphs on screen than the cache holds, the rest stay blank
+    switch (slot ? slot->state : SLOT_PENDING) {
+        case SLOT_LOADED:
+            dsc->adv_w = slot->adv_w;
+            dsc->box_w = slot->box_w;
+            dsc->box_h = slot->box_h;
+            dsc->ofs_x = slot->ofs_x;
+            dsc->ofs_y = slot->ofs_y;
+            dsc->format = LV_FONT_GLYPH_FORMAT_A1;
+        break;
+        case SLOT_MISSING:
+            k_spin_unlock(&cache_lock, key);
+            return false;
+        default:
+            // Not loaded yet, keep the space and redraw when it is
+            if (slot) slot->drawn_blank = true;
+            dsc->adv_w = header.default_adv;
+            dsc->box_w = 0;
+            dsc->box_h = 0;
+            dsc->ofs_x = 0;
+            dsc->ofs_y = 0;
+            dsc->format = LV_FONT_GLYPH_FORMAT_NONE;
+        break;
+    }
+    k_spin_unlock(&cache_lock, key);
+
+    if (queue) request(letter);
+
+    dsc->gid.index = letter;
+    dsc->is_placeholder = 0;
+    return true;
+}
+
+// Expands the cached 1bpp rows into the A8 buffer LVGL draws from
+static const void *get_glyph_bitmap(lv_font_glyph_dsc_t *dsc, lv_draw_buf_t *draw_buf) {
+    const void *result = NULL;
+
+    k_spinlock_key_t key = k_spin_lock(&cache_lock);
+    struct glyph_slot *slot = find_slot(dsc->gid.index);
+    if (slot && slot->state == SLOT_LOADED && slot->box_w == dsc->box_w && slot->box_h == dsc->box_h) {
+        uint32_t row_bytes = (slot->box_w + 7) / 8;
+        for (uint32_t y = 0; y < slot->box_h; y++) {
+            uint8_t *out = draw_buf->data + y * draw_buf->header.stride;
+            const uint8_t *row = slot->bitmap + y * row_bytes;
+            for (uint32_t x = 0; x < slot->box_w; x++) {
+                out[x] = (row[x / 8] & (0x80 >> (x % 8))) ? 0xFF : 0x00;
+            }
+        }
+        result = draw_buf;
+    } else {
+        // Changed since the layout pass, draw it again next frame
+        atomic_set(&redraw_needed, 1);
+    }
+    k_spin_unlock(&cache_lock, key);
+    return result;
+}
+
+static int read_at(off_t offset, void *buf, size_t len) {
+    int rc = fs_seek(&font_file, offset, FS_SEEK_SET);
+    if (rc < 0) return rc;
+
+    ssize_t rd = fs_read(&font_file, buf, len);
+    if (rd < 0) return rd;
+    return rd == len ? 0 : -EIO;
+}
+
+// Index page last read by the loader, neighbouring codepoints usually share it
+static struct font_file_glyph page[FONT_GLYPHS_PER_PAGE];
+static int32_t page_loaded = -1;
+
+static int lookup(uint32_t codepoint, struct font_file_glyph *out) {
+    // Last page starting at or before the codepoint
+    uint32_t lo = 0;
+    uint32_t hi = page_count;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (page_first[mid] <= codepoint) lo = mid;
+        else hi = mid;
+    }
+
+    if (page_loaded != (int32_t) lo) {
+        int rc = read_at(header.index_offset + (off_t) lo * CARD_SECTOR_SIZE, page, sizeof(page));
+        if (rc < 0) {
+            page_loaded = -1;
+            return rc;
+        }
+        page_loaded = lo;
+    }
+
+    uint32_t count = MIN(FONT_GLYPHS_PER_PAGE, header.glyph_count - lo * FONT_GLYPHS_PER_PAGE);
+    uint32_t a = 0;
+    uint32_t b = count;
+    while (a < b) {
+        uint32_t mid = (a + b) / 2;
+        if (page[mid].codepoint < codepoint) a = mid + 1;
+        else b = mid;
+    }
+    if (a == count || page[a].codepoint != codepoint) return -ENOENT;
+
+    *out = page[a];
+    return 0;
+}
+
+static void load_glyph(uint32_t codepoint) {
+    struct font_file_glyph glyph;
+    uint8_t bitmap[FONT_MAX_GLYPH_BYTES];
+    bool found = false;
+
+    if (lookup(codepoint, &glyph) == 0 && glyph.box_w <= FONT_MAX_GLYPH_DIM && glyph.box_h <= FONT_MAX_GLYPH_DIM) {
+        size_t size = glyph.box_h * ((glyph.box_w + 7) / 8);
+        found = read_at(header.bitmaps_offset + glyph.bitmap, bitmap, size) == 0;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&cache_lock);
+    struct glyph_slot *slot = find_slot(codepoint);
+    if (slot && slot->state == SLOT_PENDING) {
+        if (found) {
+            slot->adv_w = glyph.adv_w;
+            slot->box_w = glyph.box_w;
+            slot->box_h = glyph.box_h;
+            slot->ofs_x = glyph.ofs_x;
+            slot->ofs_y = glyph.ofs_y;
+            memcpy(slot->bitmap, bitmap, sizeof(bitmap));
+            slot->state = SLOT_LOADED;
+        } else {
+            slot->state = SLOT_MISSING;
+        }
+        if (slot->drawn_blank) atomic_set(&redraw_needed, 1);
+    }
+    k_spin_unlock(&cache_lock, key);
+}
+
+static void font_loader_thread(void *arg1, void *arg2, void *arg3) {
+    uint32_t codepoint;
+    while (1) {
+        k_msgq_get(&request_queue, &codepoint, K_FOREVER);
+        load_glyph(codepoint);
+    }
+}
+
+K_THREAD_DEFINE(font_tid, 2048, font_loader_thread, NULL, NULL, NULL, FONT_THREAD_PRIO, 0, 0);
+
+const lv_font_t *sd_font_open(const lv_font_t *fallback) {
+    if (font_open) return &sd_font;
+
+    fs_file_t_init(&font_file);
+    int rc = fs_open(&font_file, SD_FONT_PATH, FS_O_READ);
+    if (rc < 0) {
+        LOG_INF("No font file on the card: %d", rc);
+        return NULL;
+    }
+
+    rc = read_at(0, &header, sizeof(header));
+    page_count = (header.glyph_count + FONT_GLYPHS_PER_PAGE - 1) / FONT_GLYPHS_PER_PAGE;
+    if (rc < 0 || memcmp(header.magic, FONT_FILE_MAGIC, 4) != 0 || header.version != FONT_FILE_VERSION
+        || header.bpp != 1 || page_count == 0 || page_count > SD_FONT_MAX_PAGES) {
+        LOG_ERR("Font file is not valid");
+        page_count = 0;
+        fs_close(&font_file);
+        return NULL;
+    }
+
+    rc = read_at(header.pages_offset, page_first, page_count * sizeof(uint32_t));
+    if (rc < 0) {
+        LOG_ERR("Failed to read font page table: %d", rc);
+        page_count = 0;
+        fs_close(&font_file);
+        return NULL;
+    }
+
+    cache_init();
+
+    sd_font.get_glyph_dsc = get_glyph_dsc;
+    sd_font.get_glyph_bitmap = get_glyph_bitmap;
+    sd_font.line_height = header.line_height;
+    sd_font.base_line = header.base_line;
+    sd_font.fallback = fallback;
+    font_open = true;
+
+    LOG_INF("Font with %u glyphs, %u px lines", header.glyph_count, header.line_height);
+    return &sd_font;
+}
+
+void sd_font_prefetch(const char *text) {
+    if (!font_open || !text) return;
+
+    const uint8_t *p = (const uint8_t *) text;
+    while (*p) {
+        uint32_t cp = collate_utf8_decode(&p);
+        if (!in_font_range(cp)) continue;
+
+        k_spinlock_key_t key = k_spin_lock(&cache_lock);
+        bool queue = find_slot(cp) == NULL && claim_slot(cp) != NULL;
+        k_spin_unlock(&cache_lock, key);
+
+        if (queue) request(cp);
+    }
+}
+
+void sd_font_poll(void) {
+    frame++;
+    if (atomic_cas(&redraw_needed, 1, 0)) {
+        lv_obj_invalidate(lv_screen_active());
+    }
+}
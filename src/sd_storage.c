@@ -1,4 +1,6 @@
 #include "sd_storage.h"
+#include "boot_prof.h"
+#include "library.h"
 
 #include "core/lv_obj.h"
 #include "misc/lv_color.h"
@@ -24,8 +26,15 @@ static bool fs_mounted = false;
 static void mount_handler(struct k_work *work);
 static void unmount_handler(struct k_work *work);
 
+static void setup_handler(struct k_work *work);
+
 K_WORK_DEFINE(mount_work, mount_handler);
 K_WORK_DEFINE(unmount_work, unmount_handler);
+K_WORK_DEFINE(setup_work, setup_handler);
+
+#define DISK_EVENT_READY  BIT(0)
+#define DISK_EVENT_FAILED BIT(1)
+K_EVENT_DEFINE(disk_event);
 
 bool is_mounted(void) {
     return fs_mounted;
@@ -66,7 +75,7 @@ static int mount_app_fs(struct fs_mount_t *mnt)
 	mnt->mnt_point = "/SD:";
 
 	rc = fs_mount(mnt);
-    fs_mounted = true;
+    fs_mounted = rc == 0;
     printk("fs_mount returned %d for mount point %s\n", rc, mnt->mnt_point);
 
 	return rc;
@@ -75,13 +84,8 @@ static int mount_app_fs(struct fs_mount_t *mnt)
 void setup_disk(void)
 {
 	struct fs_mount_t *mp = &fs_mnt;
-	struct fs_dir_t dir;
 	int rc;
 
-    
-	fs_dir_t_init(&dir);
-
-
     rc = disk_access_ioctl("SD", DISK_IOCTL_CTRL_INIT, NULL);
     if (rc != 0) {
         LOG_ERR("Failed to init SD: %d", rc);
@@ -96,36 +100,111 @@ void setup_disk(void)
 	}
 
 	printk("Mount %s: %d\n", fs_mnt.mnt_point, rc);
+}
 
-	rc = fs_opendir(&dir, mp->mnt_point);
-	printk("%s opendir: %d\n", mp->mnt_point, rc);
+static void setup_handler(struct k_work *work) {
+    setup_disk();
+    boot_mark(BOOT_DISK_READY);
+    k_event_post(&disk_event, fs_mounted ? DISK_EVENT_READY : DISK_EVENT_FAILED);
+}
 
-	if (rc < 0) {
-		LOG_ERR("Failed to open directory");
-	}
+// Mounts the card on the system workqueue so display and audio init can run meanwhile
+void setup_disk_async(void) {
+    k_work_submit(&setup_work);
+}
 
-	while (rc >= 0) {
-		struct fs_dirent ent = { 0 };
-
-		rc = fs_readdir(&dir, &ent);
-		if (rc < 0) {
-			LOG_ERR("Failed to read directory entries");
-			break;
-		}
-		if (ent.name[0] == 0) {
-			printk("End of files\n");
-			break;
-		}
-		printk("  %c %u %s\n",
-		       (ent.type == FS_DIR_ENTRY_FILE) ? 'F' : 'D',
-		       ent.size,
-		       ent.name);
-	}
+int wait_for_disk(k_timeout_t timeout) {
+    uint32_t events = k_event_wait(&disk_event, DISK_EVENT_READY | DISK_EVENT_FAILED, false, timeout);
+    if (events == 0) return -EAGAIN;
+    return (events & DISK_EVENT_READY) ? 0 : -EIO;
+}
 
-	(void)fs_closedir(&dir);
+// Rows built per fill, enough to scroll through without holding every title
+#define LIST_WINDOW_ROWS 32
+
+// The rows are a window onto one sorted table, starting at window_first
+static uint8_t window_field;
+static uint32_t window_first;
+static lv_obj_t *selected_row;
+
+static lv_obj_t *add_list_row(lv_obj_t *list, const char *text) {
+    lv_obj_t *list_item = lv_list_add_text(list, text);
+    lv_obj_set_style_bg_color(list_item, lv_color_black(), LV_PART_MAIN);
+    lv_obj_set_style_text_color(list_item, lv_color_white(), 0);
+    lv_obj_set_style_bg_color(list_item, lv_color_white(), LV_PART_MAIN | LV_STATE_CHECKED);
+    lv_obj_set_style_bg_opa(list_item, LV_OPA_COVER, LV_PART_MAIN | LV_STATE_CHECKED);
+    lv_obj_set_style_text_color(list_item, lv_color_black(), LV_PART_MAIN | LV_STATE_CHECKED);
+    return list_item;
+}
+
+int populate_list_from(lv_obj_t *list, struct library_cursor *cursor) {
+    lv_obj_clean(list);
+    selected_row = NULL;
+    window_field = cursor->field;
+    if (library_sort_tell(cursor, &window_first) < 0) window_first = 0;
+
+    int count = 0;
+    uint32_t track;
+    while (count < LIST_WINDOW_ROWS && library_sort_next(cursor, &track) == 0) {
+        struct library_index_entry entry;
+        char name[LIBRARY_PATH_MAX];
+        uint32_t offset;
+
+        if (library_get_entry(track, &entry) < 0) break;
+        switch (cursor->field) {
+            case LIBRARY_SORT_ARTIST:
+                offset = entry.artist;
+            break;
+            case LIBRARY_SORT_ALBUM:
+                offset = entry.album;
+            break;
+            default:
+                offset = entry.title;
+            break;
+        }
+        if (library_get_string(offset, name, sizeof(name)) < 0) break;
+
+        lv_obj_t *row = add_list_row(list, name);
+        lv_obj_set_user_data(row, (void *) (uintptr_t) track);
+        count++;
+    }
+    return count;
+}
+
+int select_list_position(lv_obj_t *list, uint32_t pos, uint32_t *track) {
+    if (library_count() == 0) return -ENODEV;
+
+    uint32_t rows = lv_obj_get_child_count(list);
+    if (pos < window_first || pos >= window_first + rows) {
+        // Refilled with the position in the middle so both ways have room
+        struct library_cursor cursor;
+        uint32_t first = pos > LIST_WINDOW_ROWS / 2 ? pos - LIST_WINDOW_ROWS / 2 : 0;
+        int rc = library_sort_seek(window_field, first, &cursor);
+        if (rc < 0) return rc;
+
+        rows = populate_list_from(list, &cursor);
+        if (pos >= window_first + rows) return -ENOENT;
+    }
+
+    lv_obj_t *row = lv_obj_get_child(list, pos - window_first);
+    if (selected_row) lv_obj_remove_state(selected_row, LV_STATE_CHECKED);
+    lv_obj_add_state(row, LV_STATE_CHECKED);
+    lv_obj_scroll_to_view(row, LV_ANIM_OFF);
+    selected_row = row;
+
+    *track = (uint32_t) (uintptr_t) lv_obj_get_user_data(row);
+    return 0;
 }
 
 int populate_list_with_files(lv_obj_t *list) {
+    // Titles in collation order when the card has been through cardprep
+    struct library_cursor cursor;
+    if (library_open() == 0 && library_sort_jump(LIBRARY_SORT_TITLE, 0, &cursor) == 0) {
+        int count = populate_list_from(list, &cursor);
+        LOG_INF("Added %d titles to list", count);
+        return count;
+    }
+
     struct fs_dir_t dir;
     struct fs_mount_t *mp = &fs_mnt;
     int rc;
@@ -154,11 +233,7 @@ int populate_list_with_files(lv_obj_t *list) {
         }
 
         if (ent.type == FS_DIR_ENTRY_FILE) {
-
-            lv_obj_t *list_item = lv_list_add_text(list, ent.name);
-            lv_obj_set_style_bg_color(list_item, lv_color_black(), LV_PART_MAIN); 
-            lv_obj_set_style_text_color(list_item, lv_color_white(), 0);
-            
+            add_list_row(list, ent.name);
             file_count++;
             
             printk("Added file to list: %s\n", ent.name);
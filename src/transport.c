@@ -0,0 +1,90 @@
+#include "transport.h"
+
+#include <string.h>
+
+void transport_init(struct transport *t) {
+    memset(t, 0, sizeof(*t));
+}
+
+void transport_start(struct transport *t, bool skip) {
+    if (!t->playing || skip) {
+        t->paused = false;
+        t->pending_fade = t->playing ? TRANSPORT_FADE_IN : TRANSPORT_FADE_NONE;
+    }
+    t->playing = true;
+}
+
+void transport_stop(struct transport *t) {
+    t->playing = false;
+    t->paused = false;
+    t->pending_fade = TRANSPORT_FADE_NONE;
+}
+
+bool transport_pausing(const struct transport *t) {
+    return t->paused || t->pending_fade == TRANSPORT_FADE_OUT;
+}
+
+bool transport_pause(struct transport *t) {
+    if (!t->playing || transport_pausing(t)) return false;
+
+    t->pending_fade = TRANSPORT_FADE_OUT;
+    return true;
+}
+
+enum transport_resume transport_resume(struct transport *t) {
+    if (!t->playing) return TRANSPORT_RESUME_IGNORED;
+
+    if (t->pending_fade == TRANSPORT_FADE_OUT) {
+        t->pending_fade = TRANSPORT_FADE_NONE;
+        return TRANSPORT_RESUME_WITHDRAWN;
+    }
+    if (!t->paused) return TRANSPORT_RESUME_IGNORED;
+
+    t->paused = false;
+    t->pending_fade = TRANSPORT_FADE_IN;
+    return TRANSPORT_RESUME_FADE_IN;
+}
+
+void transport_step(struct transport *t, const struct transport_ops *ops, void *ctx) {
+    void *slot = NULL;
+    if (t->playing) {
+        slot = ops->slot_acquire(ctx);
+        if (!slot) {
+            transport_stop(t);
+        }
+    }
+
+    // Everything queued is handled before the next block
+    bool wait = !t->playing;
+    while (ops->command(ctx, wait)) {
+        wait = false;
+        // Stopped, the slot goes back so a later start can prefill the DMA
+        if (slot && !t->playing) {
+            ops->slot_release(ctx, slot);
+            slot = NULL;
+        }
+    }
+    // Started from stopped, the next pass waits for a slot
+    if (!slot) return;
+
+    if (t->paused) {
+        if (ops->silence(ctx, slot) < 0) {
+            transport_stop(t);
+        }
+        return;
+    }
+
+    enum transport_fade fade = t->pending_fade;
+    bool end = false;
+    int rc = ops->audio(ctx, slot, fade, &end);
+    if (rc < 0) {
+        transport_stop(t);
+        return;
+    }
+    if (rc > 0) {
+        // Faded out, the decoder and file stay where they are until resumed
+        if (fade == TRANSPORT_FADE_OUT) t->paused = true;
+        t->pending_fade = TRANSPORT_FADE_NONE;
+    }
+    ops->packet_done(ctx, end);
+}
@@ -0,0 +1,355 @@
+#include "visualizer.h"
+#include "audio_playback.h"
+#include "clock_governor.h"
+
+#include <math.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(visualizer, LOG_LEVEL_DBG);
+
+// Decode load thresholds in percent of the block period, with hysteresis
+#define LOAD_REDUCE_UP    50
+#define LOAD_REDUCE_DOWN  40
+#define LOAD_VU_ONLY_UP   75
+#define LOAD_VU_ONLY_DOWN 65
+
+#define STATS_LOG_INTERVAL 256
+
+// Copies tried before a reader racing the publisher gives up for this frame
+#define VIS_READ_ATTEMPTS 2
+
+struct vis_snapshot {
+    int16_t mid[VIS_FFT_SIZE_MAX];
+    uint16_t count;
+    uint16_t peak_left;
+    uint16_t peak_right;
+    uint8_t level;
+};
+
+// Single producer (audio thread), single consumer (visualizer thread)
+static struct vis_snapshot ring[VIS_RING_SLOTS];
+static atomic_t ring_head;
+static atomic_t ring_tail;
+static atomic_t dropped;
+static K_SEM_DEFINE(vis_sem, 0, 1);
+
+// Producer side load tracking, only touched by the audio thread
+static uint32_t load_avg;
+static uint8_t level = VIS_LEVEL_FULL;
+static uint32_t block_counter;
+
+// Published result, guarded by a sequence counter so readers never lock
+static atomic_t frame_seq;
+static struct vis_frame published;
+
+static struct vis_stats stats;
+
+static int16_t fft_re[VIS_FFT_SIZE_MAX];
+static int16_t fft_im[VIS_FFT_SIZE_MAX];
+static int16_t twiddle_cos[VIS_FFT_SIZE_MAX];
+static int16_t twiddle_sin[VIS_FFT_SIZE_MAX];
+static int16_t window[VIS_FFT_SIZE_MAX];
+static uint8_t bar_state[VIS_BARS];
+
+// Bar edges in bins of the 256 point FFT, roughly logarithmic
+static const uint8_t bar_edges[VIS_BARS + 1] = {
+    1, 2, 3, 4, 6, 8, 10, 13, 16, 20, 25, 32, 40, 52, 66, 84, 128
+};
+
+static void update_level(int frames, uint32_t decode_us) {
+    uint32_t budget = FRAMES_TO_US(frames);
+    if (budget == 0) return;
+
+    uint32_t load = (uint32_t)(((uint64_t)decode_us * 100) / budget);
+    load_avg = (load_avg * 7 + load) / 8;
+
+    switch (level) {
+        case VIS_LEVEL_FULL:
+            if (load_avg > LOAD_REDUCE_UP) level = VIS_LEVEL_REDUCED;
+        break;
+        case VIS_LEVEL_REDUCED:
+            if (load_avg > LOAD_VU_ONLY_UP) level = VIS_LEVEL_VU_ONLY;
+            else if (load_avg < LOAD_REDUCE_DOWN) level = VIS_LEVEL_FULL;
+        break;
+        case VIS_LEVEL_VU_ONLY:
+            if (load_avg < LOAD_VU_ONLY_DOWN) level = VIS_LEVEL_REDUCED;
+        break;
+    }
+}
+
+void visualizer_submit(const int16_t *pcm, int frames, uint32_t decode_us) {
+    if (frames <= 0) return;
+
+    update_level(frames, decode_us);
+    block_counter++;
+
+    if (level != VIS_LEVEL_FULL && (block_counter & 1)) {
+        return;
+    }
+
+    atomic_val_t head = atomic_get(&ring_head);
+    if (head - atomic_get(&ring_tail) >= VIS_RING_SLOTS) {
+        atomic_inc(&dropped);
+        return;
+    }
+
+    struct vis_snapshot *snap = &ring[head % VIS_RING_SLOTS];
+    int count = frames / VIS_DECIMATION;
+    if (count > VIS_FFT_SIZE_MAX) count = VIS_FFT_SIZE_MAX;
+
+    uint16_t peak_left = 0;
+    uint16_t peak_right = 0;
+    for (int i = 0; i < count; i++) {
+        int16_t left = pcm[i * VIS_DECIMATION * CHANNELS];
+        int16_t right = pcm[i * VIS_DECIMATION * CHANNELS + 1];
+        uint16_t abs_left = left < 0 ? -left : left;
+        uint16_t abs_right = right < 0 ? -right : right;
+        if (abs_left > peak_left) peak_left = abs_left;
+        if (abs_right > peak_right) peak_right = abs_right;
+        snap->mid[i] = (int16_t)(((int32_t)left + right) >> 1);
+    }
+    snap->count = count;
+    snap->peak_left = peak_left;
+    snap->peak_right = peak_right;
+    snap->level = level;
+
+    atomic_set(&ring_head, head + 1);
+    k_sem_give(&vis_sem);
+}
+
+static void fft_tables_init(void) {
+    for (int i = 0; i < VIS_FFT_SIZE_MAX; i++) {
+        float phase = 2.0f * (float)M_PI * i / VIS_FFT_SIZE_MAX;
+        twiddle_cos[i] = (int16_t)lroundf(cosf(phase) * 32767.0f);
+        twiddle_sin[i] = (int16_t)lroundf(sinf(phase) * 32767.0f);
+        window[i] = (int16_t)lroundf((0.5f - 0.5f * cosf(phase)) * 32767.0f);
+    }
+}
+
+static inline void twiddle_mul(int16_t *re, int16_t *im, int idx) {
+    int32_t wr = twiddle_cos[idx];
+    int32_t wi = -twiddle_sin[idx];
+    int32_t r = ((int32_t)*re * wr - (int32_t)*im * wi) >> 15;
+    int32_t i = ((int32_t)*re * wi + (int32_t)*im * wr) >> 15;
+    *re = (int16_t)r;
+    *im = (int16_t)i;
+}
+
+// In-place radix-4 decimation in frequency FFT in Q15, scaled by 1/4 per stage
+// so the output can't overflow. Output is left in base-4 digit reversed order.
+static void fft_radix4(int n) {
+    int tw_scale = VIS_FFT_SIZE_MAX / n;
+
+    for (int len = n; len >= 4; len >>= 2) {
+        int quarter = len >> 2;
+        int step = (n / len) * tw_scale;
+
+        for (int base = 0; base < n; base += len) {
+            for (int j = 0; j < quarter; j++) {
+                int a = base + j;
+                int b = a + quarter;
+                int c = b + quarter;
+                int d = c + quarter;
+
+                int32_t t0r = (int32_t)fft_re[a] + fft_re[c];
+                int32_t t0i = (int32_t)fft_im[a] + fft_im[c];
+                int32_t t1r = (int32_t)fft_re[a] - fft_re[c];
+                int32_t t1i = (int32_t)fft_im[a] - fft_im[c];
+                int32_t t2r = (int32_t)fft_re[b] + fft_re[d];
+                int32_t t2i = (int32_t)fft_im[b] + fft_im[d];
+                int32_t t3r = (int32_t)fft_re[b] - fft_re[d];
+                int32_t t3i = (int32_t)fft_im[b] - fft_im[d];
+
+                fft_re[a] = (int16_t)((t0r + t2r) >> 2);
+                fft_im[a] = (int16_t)((t0i + t2i) >> 2);
+                // y1 = t1 - j*t3, y3 = t1 + j*t3
+                fft_re[b] = (int16_t)((t1r + t3i) >> 2);
+                fft_im[b] = (int16_t)((t1i - t3r) >> 2);
+                fft_re[c] = (int16_t)((t0r - t2r) >> 2);
+                fft_im[c] = (int16_t)((t0i - t2i) >> 2);
+                fft_re[d] = (int16_t)((t1r - t3i) >> 2);
+                fft_im[d] = (int16_t)((t1i + t3r) >> 2);
+
+                if (j != 0) {
+                    twiddle_mul(&fft_re[b], &fft_im[b], j * step);
+                    twiddle_mul(&fft_re[c], &fft_im[c], 2 * j * step);
+                    twiddle_mul(&fft_re[d], &fft_im[d], 3 * j * step);
+                }
+            }
+        }
+    }
+}
+
+static inline int digit_reverse4(int k, int n) {
+    int r = 0;
+    for (int m = n; m > 1; m >>= 2) {
+        r = (r << 2) | (k & 3);
+        k >>= 2;
+    }
+    return r;
+}
+
+// Log2 style scale, two steps per bit
+static uint8_t log_scale(uint32_t v) {
+    if (v == 0) return 0;
+    int msb = 31 - __builtin_clz(v);
+    uint32_t out = msb * 2 + (msb > 0 ? (v >> (msb - 1)) & 1 : 0);
+    return out > VIS_BAR_MAX ? VIS_BAR_MAX : out;
+}
+
+static void publish(const struct vis_frame *frame) {
+    atomic_inc(&frame_seq);
+    published = *frame;
+    atomic_inc(&frame_seq);
+}
+
+static void analyse(const struct vis_snapshot *snap) {
+    struct vis_frame frame = {0};
+
+    frame.vu_left = log_scale(snap->peak_left);
+    frame.vu_right = log_scale(snap->peak_right);
+    frame.level = snap->level;
+
+    if (snap->level != VIS_LEVEL_VU_ONLY) {
+        int n = snap->level == VIS_LEVEL_FULL ? VIS_FFT_SIZE_MAX : VIS_FFT_SIZE_MIN;
+        int win_step = VIS_FFT_SIZE_MAX / n;
+
+        for (int i = 0; i < n; i++) {
+            int16_t s = i < snap->count ? snap->mid[i] : 0;
+            fft_re[i] = (int16_t)(((int32_t)s * window[i * win_step]) >> 15);
+            fft_im[i] = 0;
+        }
+
+        fft_radix4(n);
+
+        for (int bar = 0; bar < VIS_BARS; bar++) {
+            int lo = bar_edges[bar] * n / VIS_FFT_SIZE_MAX;
+            int hi = bar_edges[bar + 1] * n / VIS_FFT_SIZE_MAX;
+            if (lo < 1) lo = 1;
+            if (hi <= lo) hi = lo + 1;
+
+            uint32_t peak = 0;
+            for (int k = lo; k < hi; k++) {
+                int idx = digit_reverse4(k, n);
+                uint32_t re = fft_re[idx] < 0 ? -fft_re[idx] : fft_re[idx];
+                uint32_t im = fft_im[idx] < 0 ? -fft_im[idx] : fft_im[idx];
+                // alpha max plus beta min magnitude estimate
+                uint32_t mag = re > im ? re + (im * 3 >> 3) : im + (re * 3 >> 3);
+                if (mag > peak) peak = mag;
+            }
+
+            // A full scale sine lands around 8192 after windowing and scaling
+            uint8_t value = log_scale(peak << 2);
+            if (value >= bar_state[bar]) {
+                bar_state[bar] = value;
+            } else {
+                bar_state[bar] = bar_state[bar] > 2 ? bar_state[bar] - 2 : 0;
+            }
+        }
+    } else {
+        memset(bar_state, 0, sizeof(bar_state));
+    }
+
+    memcpy(frame.bars, bar_state, sizeof(frame.bars));
+    publish(&frame);
+}
+
+static void visualizer_thread(void *arg1, void *arg2, void *arg3) {
+    fft_tables_init();
+    uint64_t us_sum = 0;
+
+    while (1) {
+        k_sem_take(&vis_sem, K_FOREVER);
+
+        atomic_val_t tail = atomic_get(&ring_tail);
+        while (tail != atomic_get(&ring_head)) {
+            timing_t start = timing_counter_get();
+            analyse(&ring[tail % VIS_RING_SLOTS]);
+            uint32_t us = clock_governor_work_us(start, timing_counter_get());
+
+            tail++;
+            atomic_set(&ring_tail, tail);
+
+            stats.frames++;
+            us_sum += us;
+            if (us > stats.max_us) stats.max_us = us;
+            stats.avg_us = (uint32_t)(us_sum / stats.frames);
+            stats.dropped = atomic_get(&dropped);
+            stats.level = level;
+
+            if ((stats.frames % STATS_LOG_INTERVAL) == 0) {
+                LOG_DBG("Visualizer: avg %u max %u us, dropped %u, level %d",
+                        stats.avg_us, stats.max_us, stats.dropped, stats.level);
+            }
+        }
+    }
+}
+
+// The writer runs at a lower priority than the UI, so a reader that catches it
+// mid publish can't wait for it to finish. It gives up and tries next frame.
+bool visualizer_get_frame(struct vis_frame *out, uint32_t *last_seq) {
+    for (int attempt = 0; attempt < VIS_READ_ATTEMPTS; attempt++) {
+        atomic_val_t seq = atomic_get(&frame_seq);
+        if (seq & 1) return false;
+        if ((uint32_t)seq == *last_seq) return false;
+
+        struct vis_frame frame = published;
+        if (seq == atomic_get(&frame_seq)) {
+            *out = frame;
+            *last_seq = seq;
+            return true;
+        }
+    }
+    return false;
+}
+
+void visualizer_get_stats(struct vis_stats *out) {
+    *out = stats;
+}
+
+#define BAR_WIDTH 3
+#define BAR_PITCH 4
+#define VU_X (256 - VIS_BARS * BAR_PITCH - 2 * BAR_PITCH)
+
+static lv_obj_t *bar_objs[VIS_BARS];
+static lv_obj_t *vu_objs[2];
+static uint32_t ui_seq;
+
+static lv_obj_t *create_bar(lv_obj_t *parent, int x) {
+    lv_obj_t *obj = lv_obj_create(parent);
+    lv_obj_remove_style_all(obj);
+    lv_obj_set_style_bg_color(obj, lv_color_white(), LV_PART_MAIN);
+    lv_obj_set_style_bg_opa(obj, LV_OPA_COVER, LV_PART_MAIN);
+    lv_obj_set_pos(obj, x, VIS_BAR_MAX);
+    lv_obj_set_size(obj, BAR_WIDTH, 1);
+    return obj;
+}
+
+static void set_bar(lv_obj_t *obj, uint8_t value) {
+    lv_obj_set_y(obj, VIS_BAR_MAX - value);
+    lv_obj_set_height(obj, value + 1);
+}
+
+void visualizer_ui_create(lv_obj_t *parent) {
+    vu_objs[0] = create_bar(parent, VU_X);
+    vu_objs[1] = create_bar(parent, VU_X + BAR_PITCH);
+    for (int i = 0; i < VIS_BARS; i++) {
+        bar_objs[i] = create_bar(parent, VU_X + (i + 2) * BAR_PITCH);
+    }
+}
+
+void visualizer_ui_update(void) {
+    struct vis_frame frame;
+    if (!visualizer_get_frame(&frame, &ui_seq)) return;
+
+    set_bar(vu_objs[0], frame.vu_left);
+    set_bar(vu_objs[1], frame.vu_right);
+    for (int i = 0; i < VIS_BARS; i++) {
+        set_bar(bar_objs[i], frame.bars[i]);
+    }
+}
+
+K_THREAD_DEFINE(vis_tid, 2048, visualizer_thread, NULL, NULL, NULL, VIS_THREAD_PRIO, 0, 0);
@@ -0,0 +1,869 @@
+// Host side card preparation tool. Rewrites a directory of Ogg Opus files into
+// the layout the player is fastest with and generates the library index.
+//
+//   cardprep [-a art_limit] <source dir> <card dir>
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "card_layout.h"
+#include "collate.h"
+#include "library_index.h"
+#include "oggparse.h"
+#include "opus_pad.h"
+
+#define ART_LIMIT_DEFAULT (16 * 1024)
+// Reserve lacing values so padding a page can't overflow its segment table
+#define PAGE_SEGMENT_BUDGET (OGG_MAX_SEGMENTS - 8)
+#define MAX_TAGS_SIZE (OGG_MAX_SEGMENTS * 255 - 1)
+
+struct packet {
+    uint8_t *data;
+    size_t len;
+    int64_t granule; // Granule position at the end of this packet
+    bool has_granule;
+};
+
+struct packet_list {
+    struct packet *items;
+    size_t count;
+    size_t cap;
+};
+
+struct out_page {
+    size_t first;
+    size_t count;
+    uint32_t offset;
+    int64_t granule;
+};
+
+struct track {
+    char *path;
+    char *title;
+    char *artist;
+    char *album;
+    // Sort order tags, NULL when the track has none
+    char *title_sort;
+    char *artist_sort;
+    char *album_sort;
+    uint32_t duration_ms;
+    uint32_t file_size;
+};
+
+struct buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+};
+
+static size_t art_limit = ART_LIMIT_DEFAULT;
+
+static void *xrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void buf_append(struct buf *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->data = xrealloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void buf_append_le32(struct buf *b, uint32_t v) {
+    uint8_t raw[4];
+    ogg_write_le32(raw, v);
+    buf_append(b, raw, 4);
+}
+
+static void packet_list_push(struct packet_list *l, const uint8_t *data, size_t len) {
+    if (l->count == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 256;
+        l->items = xrealloc(l->items, l->cap * sizeof(*l->items));
+    }
+    struct packet *pk = &l->items[l->count++];
+    memset(pk, 0, sizeof(*pk));
+    pk->data = xrealloc(NULL, len ? len : 1);
+    memcpy(pk->data, data, len);
+    pk->len = len;
+}
+
+static void packet_list_free(struct packet_list *l) {
+    for (size_t i = 0; i < l->count; i++) free(l->items[i].data);
+    free(l->items);
+    memset(l, 0, sizeof(*l));
+}
+
+static uint8_t *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < 0) {
+        fclose(f);
+        return NULL;
+    }
+
+    uint8_t *data = xrealloc(NULL, size ? size : 1);
+    if (fread(data, 1, size, f) != (size_t)size) {
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *len = size;
+    return data;
+}
+
+static int demux(const uint8_t *data, size_t len, struct packet_list *packets) {
+    struct ogg_parser parser;
+    uint8_t *packet_buf = xrealloc(NULL, len);
+    ogg_parser_init(&parser, packet_buf, len);
+
+    size_t pos = 0;
+    bool have_serial = false;
+    uint32_t serial = 0;
+    int rc = 0;
+
+    while (1) {
+        size_t consumed;
+        int res = ogg_parser_feed(&parser, data + pos, len - pos, &consumed);
+        pos += consumed;
+
+        if (res == OGG_NEED_MORE) break;
+        if (res < 0) {
+            fprintf(stderr, "  Ogg parse error %d at offset %zu\n", res, pos);
+            rc = -1;
+            break;
+        }
+
+        if (!have_serial) {
+            serial = parser.page.serial;
+            have_serial = true;
+        } else if (parser.page.serial != serial) {
+            fprintf(stderr, "  Multiplexed or chained streams are not supported\n");
+            rc = -1;
+            break;
+        }
+
+        packet_list_push(packets, parser.packet_buf, parser.packet_size);
+        struct packet *pk = &packets->items[packets->count - 1];
+        if (parser.packet_last_on_page && parser.page.granule != -1) {
+            pk->granule = parser.page.granule;
+            pk->has_granule = true;
+        }
+        if (parser.packet_eos) break;
+    }
+
+    free(packet_buf);
+    return rc;
+}
+
+static int base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+static size_t base64_decode(const uint8_t *in, size_t len, uint8_t *out) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        int v = base64_value(in[i]);
+        if (v < 0) continue;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Pulls the image out of a METADATA_BLOCK_PICTURE value into a sidecar file
+static int write_sidecar_art(const char *card_dir, const char *stem, int index,
+                             const uint8_t *value, size_t len) {
+    uint8_t *block = xrealloc(NULL, len);
+    size_t block_len = base64_decode(value, len, block);
+    int rc = -1;
+
+    size_t pos = 4;
+    if (block_len < pos + 4) goto out;
+    uint32_t mime_len = read_be32(block + pos);
+    pos += 4;
+    if (block_len - pos < mime_len + 4) goto out;
+    const char *ext = "bin";
+    if (mime_len == 10 && memcmp(block + pos, "image/jpeg", 10) == 0) ext = "jpg";
+    if (mime_len == 9 && memcmp(block + pos, "image/png", 9) == 0) ext = "png";
+    pos += mime_len;
+
+    uint32_t desc_len = read_be32(block + pos);
+    pos += 4;
+    if (block_len - pos < (size_t)desc_len + 20) goto out;
+    pos += desc_len + 16;
+
+    uint32_t data_len = read_be32(block + pos);
+    pos += 4;
+    if (block_len - pos < data_len) goto out;
+
+    char path[4096];
+    if (index == 0) {
+        snprintf(path, sizeof(path), "%s/%s.%s", card_dir, stem, ext);
+    } else {
+        snprintf(path, sizeof(path), "%s/%s-%d.%s", card_dir, stem, index, ext);
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (!f) goto out;
+    if (fwrite(block + pos, 1, data_len, f) == data_len) rc = 0;
+    fclose(f);
+    printf("  Art: %s (%u bytes)\n", path, data_len);
+
+out:
+    free(block);
+    return rc;
+}
+
+static bool tag_is(const uint8_t *comment, uint32_t len, const char *key) {
+    size_t key_len = strlen(key);
+    return len > key_len && comment[key_len] == '=' && strncasecmp((const char *)comment, key, key_len) == 0;
+}
+
+static char *tag_value(const uint8_t *comment, uint32_t len, const char *key) {
+    size_t key_len = strlen(key) + 1;
+    char *value = xrealloc(NULL, len - key_len + 1);
+    memcpy(value, comment + key_len, len - key_len);
+    value[len - key_len] = 0;
+    return value;
+}
+
+// Rebuilds OpusTags without oversized art. The seek table is appended later.
+static int rebuild_tags(const struct packet *tags_pkt, const char *card_dir, const char *stem,
+                        struct track *track, struct buf *out, bool strip_all_art) {
+    struct opus_tags_iter it;
+    const uint8_t *vendor;
+    uint32_t vendor_len;
+    if (opus_tags_iter_init(&it, tags_pkt->data, tags_pkt->len, &vendor, &vendor_len) < 0) {
+        fprintf(stderr, "  Missing OpusTags\n");
+        return -1;
+    }
+
+    struct buf comments = {0};
+    uint32_t kept = 0;
+    int art_index = 0;
+    const uint8_t *comment;
+    uint32_t comment_len;
+
+    while (opus_tags_iter_next(&it, &comment, &comment_len)) {
+        if (tag_is(comment, comment_len, "METADATA_BLOCK_PICTURE") &&
+            (strip_all_art || comment_len > art_limit)) {
+            size_t key_len = strlen("METADATA_BLOCK_PICTURE=");
+            if (write_sidecar_art(card_dir, stem, art_index, comment + key_len, comment_len - key_len) == 0) {
+                art_index++;
+            } else {
+                fprintf(stderr, "  Dropping unreadable picture block\n");
+            }
+            continue;
+        }
+
+        if (!track->title && tag_is(comment, comment_len, "TITLE")) {
+            track->title = tag_value(comment, comment_len, "TITLE");
+        } else if (!track->artist && tag_is(comment, comment_len, "ARTIST")) {
+            track->artist = tag_value(comment, comment_len, "ARTIST");
+        } else if (!track->album && tag_is(comment, comment_len, "ALBUM")) {
+            track->album = tag_value(comment, comment_len, "ALBUM");
+        } else if (!track->title_sort && tag_is(comment, comment_len, "TITLESORT")) {
+            track->title_sort = tag_value(comment, comment_len, "TITLESORT");
+        } else if (!track->artist_sort && tag_is(comment, comment_len, "ARTISTSORT")) {
+            track->artist_sort = tag_value(comment, comment_len, "ARTISTSORT");
+        } else if (!track->album_sort && tag_is(comment, comment_len, "ALBUMSORT")) {
+            track->album_sort = tag_value(comment, comment_len, "ALBUMSORT");
+        }
+
+        buf_append_le32(&comments, comment_len);
+        buf_append(&comments, comment, comment_len);
+        kept++;
+    }
+
+    out->len = 0;
+    buf_append(out, "OpusTags", 8);
+    buf_append_le32(out, vendor_len);
+    buf_append(out, vendor, vendor_len);
+    buf_append_le32(out, kept);
+    buf_append(out, comments.data, comments.len);
+    free(comments.data);
+    return 0;
+}
+
+static size_t lacing_count(size_t len) {
+    return len / 255 + 1;
+}
+
+static size_t page_size(const struct packet *pk, size_t count) {
+    size_t size = OGG_PAGE_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        size += lacing_count(pk[i].len) + pk[i].len;
+    }
+    return size;
+}
+
+static size_t page_segments(const struct packet *pk, size_t count) {
+    size_t segs = 0;
+    for (size_t i = 0; i < count; i++) segs += lacing_count(pk[i].len);
+    return segs;
+}
+
+// Grows one packet on the page with Opus padding so the page ends on a sector
+// boundary. start is the page offset from the (sector aligned) first audio page.
+static bool align_page(struct packet *pk, size_t count, size_t start) {
+    uint8_t tmp[CARD_MAX_PACKET];
+    size_t size = page_size(pk, count);
+    size_t segs = page_segments(pk, count);
+    if ((start + size) % CARD_SECTOR_SIZE == 0) return true;
+
+    size_t end = (start + size + CARD_SECTOR_SIZE - 1) / CARD_SECTOR_SIZE * CARD_SECTOR_SIZE;
+    for (; end <= start + size + 2 * CARD_SECTOR_SIZE; end += CARD_SECTOR_SIZE) {
+        size_t target = end - start;
+
+        for (size_t i = count; i-- > 0;) {
+            struct packet *p = &pk[i];
+            size_t others = size - lacing_count(p->len) - p->len;
+
+            for (size_t new_len = p->len + 1; new_len <= CARD_MAX_PACKET; new_len++) {
+                size_t total = others + lacing_count(new_len) + new_len;
+                if (total < target) continue;
+                if (total > target) break;
+                if (segs - lacing_count(p->len) + lacing_count(new_len) > OGG_MAX_SEGMENTS) break;
+                if (opus_pad_to(p->data, p->len, tmp, new_len) < 0) break;
+
+                p->data = xrealloc(p->data, new_len);
+                memcpy(p->data, tmp, new_len);
+                p->len = new_len;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void write_page(struct buf *out, uint8_t flags, int64_t granule, uint32_t serial,
+                       uint32_t sequence, const struct packet *pk, size_t count) {
+    uint8_t header[OGG_PAGE_HEADER_SIZE];
+    uint8_t lacing[OGG_MAX_SEGMENTS];
+    size_t nsegs = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t len = pk[i].len;
+        while (len >= 255) {
+            lacing[nsegs++] = 255;
+            len -= 255;
+        }
+        lacing[nsegs++] = len;
+    }
+
+    struct ogg_page_header hdr = {
+        .flags = flags,
+        .granule = granule,
+        .serial = serial,
+        .sequence = sequence,
+        .checksum = 0,
+        .segment_count = nsegs,
+    };
+    ogg_page_header_write(header, &hdr);
+
+    uint32_t crc = ogg_crc_update(0, header, sizeof(header));
+    crc = ogg_crc_update(crc, lacing, nsegs);
+    for (size_t i = 0; i < count; i++) crc = ogg_crc_update(crc, pk[i].data, pk[i].len);
+    ogg_write_le32(header + 22, crc);
+
+    buf_append(out, header, sizeof(header));
+    buf_append(out, lacing, nsegs);
+    for (size_t i = 0; i < count; i++) buf_append(out, pk[i].data, pk[i].len);
+}
+
+static int write_file(const char *path, const struct buf *b) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f) return -1;
+    bool ok = fwrite(b->data, 1, b->len, f) == b->len;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int process_file(const char *src_dir, const char *card_dir, const char *name, struct track *track) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", src_dir, name);
+
+    size_t len;
+    uint8_t *data = read_file(path, &len);
+    if (!data) {
+        fprintf(stderr, "  Failed to read %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct packet_list packets = {0};
+    struct buf tags = {0};
+    struct buf out = {0};
+    struct out_page *pages = NULL;
+    uint32_t serial = 0;
+    int rc = -1;
+
+    if (demux(data, len, &packets) < 0) goto out;
+    if (packets.count < 3) {
+        fprintf(stderr, "  Not enough packets\n");
+        goto out;
+    }
+
+    struct opus_head head;
+    if (opus_head_parse(packets.items[0].data, packets.items[0].len, &head) < 0 ||
+        head.mapping_family != 0 || packets.items[0].len != OPUS_HEAD_MIN_SIZE) {
+        fprintf(stderr, "  Unsupported OpusHead, only mapping family 0 is handled\n");
+        goto out;
+    }
+
+    {
+        struct ogg_page_header first;
+        ogg_page_header_parse(data, &first);
+        serial = first.serial;
+    }
+
+    // Reconstruct the end granule of every audio packet from the TOC durations
+    struct packet *audio = packets.items + 2;
+    size_t audio_count = packets.count - 2;
+    int64_t total = 0;
+    int64_t base = 0;
+    bool have_base = false;
+    for (size_t i = 0; i < audio_count; i++) {
+        int samples = opus_toc_samples(audio[i].data, audio[i].len);
+        if (samples < 0) {
+            fprintf(stderr, "  Invalid Opus packet %zu\n", i);
+            goto out;
+        }
+        total += samples;
+        if (!have_base && audio[i].has_granule) {
+            base = audio[i].granule - total;
+            have_base = true;
+        }
+    }
+
+    int64_t end_granule = base + total;
+    if (audio[audio_count - 1].has_granule) {
+        // Keeps end trimming of the original stream
+        end_granule = audio[audio_count - 1].granule;
+    }
+
+    int64_t running = base;
+    for (size_t i = 0; i < audio_count; i++) {
+        running += opus_toc_samples(audio[i].data, audio[i].len);
+        audio[i].granule = running;
+    }
+
+    // Re-page the audio into large pages and pad each one to whole sectors
+    size_t page_count = 0;
+    pages = xrealloc(NULL, (audio_count + 1) * sizeof(*pages));
+    uint32_t unaligned = 0;
+    uint32_t offset = 0;
+    for (size_t i = 0; i < audio_count;) {
+        size_t count = 1;
+        while (i + count < audio_count &&
+               page_size(audio + i, count + 1) <= CARD_PAGE_TARGET &&
+               page_segments(audio + i, count + 1) <= PAGE_SEGMENT_BUDGET) {
+            count++;
+        }
+
+        if (!align_page(audio + i, count, offset)) unaligned++;
+
+        struct out_page *pg = &pages[page_count++];
+        pg->first = i;
+        pg->count = count;
+        pg->offset = offset;
+        pg->granule = audio[i + count - 1].granule;
+        offset += page_size(audio + i, count);
+        i += count;
+    }
+    pages[page_count - 1].granule = end_granule;
+
+    const char *dot = strrchr(name, '.');
+    char stem[1024];
+    snprintf(stem, sizeof(stem), "%.*s", (int)(dot ? dot - name : (long)strlen(name)), name);
+
+    bool strip_all_art = false;
+    uint16_t seek_entries = 0;
+    while (1) {
+        if (rebuild_tags(&packets.items[1], card_dir, stem, track, &tags, strip_all_art) < 0) goto out;
+
+        // Seek table, one entry per interval, offsets relative to the first audio page
+        struct buf seek = {0};
+        struct seek_table_header sh = {0};
+        memcpy(sh.magic, SEEK_TABLE_MAGIC, SEEK_TABLE_MAGIC_LEN);
+        sh.version = SEEK_TABLE_VERSION;
+        sh.interval = SEEK_TABLE_INTERVAL;
+        buf_append(&seek, &sh, sizeof(sh));
+
+        int64_t next = base;
+        int64_t page_start = base;
+        for (size_t p = 0; p < page_count && sh.count < UINT16_MAX; p++) {
+            if (page_start >= next) {
+                struct seek_table_entry e = {
+                    .granule = (uint32_t)page_start,
+                    .offset = pages[p].offset,
+                };
+                buf_append(&seek, &e, sizeof(e));
+                sh.count++;
+                next = page_start + SEEK_TABLE_INTERVAL;
+            }
+            page_start = pages[p].granule;
+        }
+        memcpy(seek.data, &sh, sizeof(sh));
+        seek_entries = sh.count;
+        buf_append(&tags, seek.data, seek.len);
+        free(seek.data);
+
+        if (tags.len <= MAX_TAGS_SIZE - CARD_SECTOR_SIZE) break;
+        if (strip_all_art) {
+            fprintf(stderr, "  OpusTags too large for a single page\n");
+            goto out;
+        }
+        strip_all_art = true;
+        free(track->title);
+        free(track->artist);
+        free(track->album);
+        free(track->title_sort);
+        free(track->artist_sort);
+        free(track->album_sort);
+        track->title = track->artist = track->album = NULL;
+        track->title_sort = track->artist_sort = track->album_sort = NULL;
+    }
+
+    // Zero pad OpusTags so the first audio page starts on a sector boundary
+    size_t head_page = page_size(&packets.items[0], 1);
+    uint8_t zero = 0;
+    while ((head_page + OGG_PAGE_HEADER_SIZE + lacing_count(tags.len) + tags.len) % CARD_SECTOR_SIZE) {
+        buf_append(&tags, &zero, 1);
+    }
+
+    struct packet tags_pkt = {.data = tags.data, .len = tags.len};
+    uint32_t sequence = 0;
+    write_page(&out, OGG_FLAG_BOS, 0, serial, sequence++, &packets.items[0], 1);
+    write_page(&out, 0, 0, serial, sequence++, &tags_pkt, 1);
+    for (size_t p = 0; p < page_count; p++) {
+        uint8_t flags = p == page_count - 1 ? OGG_FLAG_EOS : 0;
+        write_page(&out, flags, pages[p].granule, serial, sequence++, audio + pages[p].first, pages[p].count);
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", card_dir, name);
+    if (write_file(path, &out) < 0) {
+        fprintf(stderr, "  Failed to write %s\n", path);
+        goto out;
+    }
+
+    int64_t samples = end_granule - head.pre_skip;
+    track->duration_ms = samples > 0 ? (uint32_t)(samples * 1000 / 48000) : 0;
+    track->file_size = out.len;
+    track->path = strdup(name);
+    if (!track->title) track->title = strdup(stem);
+    if (!track->artist) track->artist = strdup("");
+    if (!track->album) track->album = strdup("");
+
+    printf("  %zu -> %zu bytes, %zu pages, %u unaligned, %u seek entries\n",
+           len, out.len, page_count + 2, unaligned, seek_entries);
+    rc = 0;
+
+out:
+    free(pages);
+    free(out.data);
+    free(tags.data);
+    packet_list_free(&packets);
+    free(data);
+    return rc;
+}
+
+static uint32_t string_add(struct buf *strings, const char *s) {
+    uint32_t offset = strings->len;
+    buf_append(strings, s, strlen(s) + 1);
+    return offset;
+}
+
+struct sort_key {
+    uint8_t key[COLLATE_KEY_MAX];
+    size_t len;
+    uint32_t track;
+};
+
+static int compare_sort_keys(const void *a, const void *b) {
+    const struct sort_key *ka = a;
+    const struct sort_key *kb = b;
+    size_t n = ka->len < kb->len ? ka->len : kb->len;
+    int c = memcmp(ka->key, kb->key, n);
+    if (c != 0) return c;
+    if (ka->len != kb->len) return ka->len < kb->len ? -1 : 1;
+    return ka->track < kb->track ? -1 : ka->track > kb->track;
+}
+
+static const char *sort_name(const struct track *t, int field) {
+    switch (field) {
+        case LIBRARY_SORT_TITLE:
+            return t->title_sort ? t->title_sort : t->title;
+        case LIBRARY_SORT_ARTIST:
+            return t->artist_sort ? t->artist_sort : t->artist;
+        default:
+            return t->album_sort ? t->album_sort : t->album;
+    }
+}
+
+static size_t write_varint(uint8_t *out, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = 0x80 | (v & 0x7F);
+        v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+}
+
+// Prefix compressed against prev, which is NULL for the first entry of a block
+static size_t encode_sort_entry(uint8_t *out, const struct sort_key *prev, const struct sort_key *key) {
+    size_t shared = 0;
+    if (prev) {
+        while (shared < prev->len && shared < key->len && prev->key[shared] == key->key[shared]) shared++;
+    }
+    out[0] = shared;
+    out[1] = key->len - shared;
+    memcpy(out + 2, key->key + shared, key->len - shared);
+    return 2 + key->len - shared + write_varint(out + 2 + key->len - shared, key->track);
+}
+
+static void flush_sort_block(struct buf *out, uint8_t *block, const struct library_sort_block_header *bh) {
+    memcpy(block, bh, sizeof(*bh));
+    memset(block + bh->size, 0, LIBRARY_SORT_BLOCK_SIZE - bh->size);
+    buf_append(out, block, LIBRARY_SORT_BLOCK_SIZE);
+}
+
+// Appends one field's sorted table to out as whole blocks and fills in table
+static void write_sort_table(struct buf *out, const struct track *tracks, size_t count, int field,
+                             struct library_sort_table *table) {
+    struct sort_key *keys = xrealloc(NULL, (count + 1) * sizeof(*keys));
+    for (size_t i = 0; i < count; i++) {
+        keys[i].len = collate_key(sort_name(&tracks[i], field), keys[i].key, COLLATE_KEY_MAX);
+        keys[i].track = i;
+    }
+    qsort(keys, count, sizeof(*keys), compare_sort_keys);
+
+    // Where each sorted position ended up, for the jump table
+    uint32_t *pos_block = xrealloc(NULL, (count + 1) * sizeof(*pos_block));
+    uint16_t *pos_index = xrealloc(NULL, (count + 1) * sizeof(*pos_index));
+
+    table->blocks_offset = out->len;
+    table->block_count = 0;
+
+    uint8_t block[LIBRARY_SORT_BLOCK_SIZE];
+    struct library_sort_block_header bh = {0};
+    for (size_t i = 0; i < count; i++) {
+        uint8_t entry[2 + COLLATE_KEY_MAX + 5];
+        size_t entry_len = encode_sort_entry(entry, bh.count ? &keys[i - 1] : NULL, &keys[i]);
+
+        if (bh.count > 0 && bh.size + entry_len > LIBRARY_SORT_BLOCK_SIZE) {
+            flush_sort_block(out, block, &bh);
+            table->block_count++;
+            bh.count = 0;
+            entry_len = encode_sort_entry(entry, NULL, &keys[i]);
+        }
+        if (bh.count == 0) {
+            bh.first_pos = i;
+            bh.size = sizeof(bh);
+        }
+
+        memcpy(block + bh.size, entry, entry_len);
+        bh.size += entry_len;
+        pos_block[i] = table->block_count;
+        pos_index[i] = bh.count++;
+    }
+    if (bh.count > 0) {
+        flush_sort_block(out, block, &bh);
+        table->block_count++;
+    }
+    pos_block[count] = table->block_count;
+    pos_index[count] = 0;
+
+    size_t pos = 0;
+    for (int b = 0; b < COLLATE_JUMP_COUNT; b++) {
+        while (pos < count && collate_jump_bucket(keys[pos].key, keys[pos].len) < b) pos++;
+        table->jump[b].block = pos_block[pos];
+        table->jump[b].index = pos_index[pos];
+    }
+
+    free(pos_index);
+    free(pos_block);
+    free(keys);
+}
+
+static int write_library_index(const char *card_dir, const struct track *tracks, size_t count) {
+    struct buf entries = {0};
+    struct buf strings = {0};
+
+    for (size_t i = 0; i < count; i++) {
+        struct library_index_entry e = {
+            .path = string_add(&strings, tracks[i].path),
+            .title = string_add(&strings, tracks[i].title),
+            .artist = string_add(&strings, tracks[i].artist),
+            .album = string_add(&strings, tracks[i].album),
+            .duration_ms = tracks[i].duration_ms,
+            .file_size = tracks[i].file_size,
+        };
+        buf_append(&entries, &e, sizeof(e));
+    }
+
+    struct library_index_header hdr = {
+        .version = LIBRARY_INDEX_VERSION,
+        .entry_size = sizeof(struct library_index_entry),
+        .track_count = count,
+        .entries_offset = sizeof(hdr),
+        .strings_offset = sizeof(hdr) + entries.len,
+        .strings_size = strings.len,
+    };
+    memcpy(hdr.magic, LIBRARY_INDEX_MAGIC, 4);
+
+    struct buf out = {0};
+    buf_append(&out, &hdr, sizeof(hdr));
+    buf_append(&out, entries.data, entries.len);
+    buf_append(&out, strings.data, strings.len);
+
+    // Sort blocks start on sector boundaries so each one is a single read
+    uint8_t zero = 0;
+    while (out.len % LIBRARY_SORT_BLOCK_SIZE) buf_append(&out, &zero, 1);
+    for (int f = 0; f < LIBRARY_SORT_COUNT; f++) {
+        write_sort_table(&out, tracks, count, f, &hdr.sort[f]);
+    }
+    memcpy(out.data, &hdr, sizeof(hdr));
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", card_dir, LIBRARY_INDEX_NAME);
+    int rc = write_file(path, &out);
+
+    free(out.data);
+    free(entries.data);
+    free(strings.data);
+    return rc;
+}
+
+static bool is_opus_name(const char *name) {
+    size_t len = strlen(name);
+    return len > 5 && strcasecmp(name + len - 5, ".opus") == 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-a art_limit] <source dir> <card dir>\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "a:h")) != -1) {
+        switch (opt) {
+            case 'a':
+                art_limit = strtoul(optarg, NULL, 0);
+            break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *src_dir = argv[optind];
+    const char *card_dir = argv[optind + 1];
+
+    DIR *dir = opendir(src_dir);
+    if (!dir) {
+        fprintf(stderr, "Failed to open %s: %s\n", src_dir, strerror(errno));
+        return 1;
+    }
+
+    char **names = NULL;
+    size_t name_count = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.' || !is_opus_name(ent->d_name)) continue;
+        names = xrealloc(names, (name_count + 1) * sizeof(*names));
+        names[name_count++] = strdup(ent->d_name);
+    }
+    closedir(dir);
+    qsort(names, name_count, sizeof(*names), compare_names);
+
+    struct track *tracks = xrealloc(NULL, (name_count + 1) * sizeof(*tracks));
+    size_t track_count = 0;
+    int failed = 0;
+
+    for (size_t i = 0; i < name_count; i++) {
+        printf("%s\n", names[i]);
+        struct track *t = &tracks[track_count];
+        memset(t, 0, sizeof(*t));
+        if (process_file(src_dir, card_dir, names[i], t) == 0) {
+            track_count++;
+        } else {
+            free(t->title);
+            free(t->artist);
+            free(t->album);
+            free(t->title_sort);
+            free(t->artist_sort);
+            free(t->album_sort);
+            failed++;
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    if (write_library_index(card_dir, tracks, track_count) < 0) {
+        fprintf(stderr, "Failed to write library index\n");
+        return 1;
+    }
+    printf("Indexed %zu tracks, %d failed\n", track_count, failed);
+
+    for (size_t i = 0; i < track_count; i++) {
+        free(tracks[i].path);
+        free(tracks[i].title);
+        free(tracks[i].artist);
+        free(tracks[i].album);
+        free(tracks[i].title_sort);
+        free(tracks[i].artist_sort);
+        free(tracks[i].album_sort);
+    }
+    free(tracks);
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+// File API on stdio for the host tests. Paths under /SD:/ open in
+// host_fs_root instead.
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define FS_O_READ 0x01
+#define FS_SEEK_SET SEEK_SET
+
+struct fs_file_t {
+    FILE *fp;
+};
+
+extern const char *host_fs_root;
+
+void fs_file_t_init(struct fs_file_t *file);
+int fs_open(struct fs_file_t *file, const char *path, int flags);
+int fs_close(struct fs_file_t *file);
+ssize_t fs_read(struct fs_file_t *file, void *buf, size_t len);
+int fs_seek(struct fs_file_t *file, off_t offset, int whence);
@@ -0,0 +1,41 @@
+#pragma once
+
+// Just enough of the kernel API for src/library.c to run on the host, see
+// library_test.c. Single threaded, so the mutex does nothing.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+typedef int k_timeout_t;
+#define K_FOREVER (-1)
+
+struct k_mutex {
+    int unused;
+};
+
+#define K_MUTEX_DEFINE(name) static struct k_mutex name
+
+static inline int k_mutex_lock(struct k_mutex *mutex, k_timeout_t timeout) {
+    (void) mutex;
+    (void) timeout;
+    return 0;
+}
+
+static inline int k_mutex_unlock(struct k_mutex *mutex) {
+    (void) mutex;
+    return 0;
+}
+
+static inline uint32_t k_cycle_get_32(void) {
+    return 0;
+}
+
+static inline uint32_t k_cyc_to_us_floor32(uint32_t cycles) {
+    return cycles;
+}
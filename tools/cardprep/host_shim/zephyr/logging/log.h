@@ -0,0 +1,11 @@
+#pragma once
+
+// Logging for the host tests, errors go to stderr and the rest is dropped
+
+#include <stdio.h>
+
+#define LOG_MODULE_REGISTER(...)
+#define LOG_ERR(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#define LOG_WRN(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#define LOG_INF(...) do { if (0) printf(__VA_ARGS__); } while (0)
+#define LOG_DBG(...) do { if (0) printf(__VA_ARGS__); } while (0)
@@ -0,0 +1,360 @@
+// Builds a card with cardprep from generated tracks and checks the player's
+// library lookups (src/library.c) against it, including how many sort blocks
+// a search reads from the card. Run with ctest after building tools/cardprep.
+//
+//   library_test <cardprep> <work dir>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zephyr/fs/fs.h>
+
+#include "collate.h"
+#include "library.h"
+#include "oggparse.h"
+
+#define TRACKS 3000
+
+static int failures;
+
+#define CHECK(cond)                                                       \
+    do {                                                                  \
+        if (!(cond)) {                                                    \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                   \
+        }                                                                 \
+    } while (0)
+
+const char *host_fs_root;
+
+void fs_file_t_init(struct fs_file_t *file) {
+    file->fp = NULL;
+}
+
+int fs_open(struct fs_file_t *file, const char *path, int flags) {
+    char host_path[4096];
+    (void) flags;
+    if (strncmp(path, "/SD:/", 5) != 0) return -ENOENT;
+
+    snprintf(host_path, sizeof(host_path), "%s/%s", host_fs_root, path + 5);
+    file->fp = fopen(host_path, "rb");
+    return file->fp ? 0 : -errno;
+}
+
+int fs_close(struct fs_file_t *file) {
+    fclose(file->fp);
+    file->fp = NULL;
+    return 0;
+}
+
+ssize_t fs_read(struct fs_file_t *file, void *buf, size_t len) {
+    return fread(buf, 1, len, file->fp);
+}
+
+int fs_seek(struct fs_file_t *file, off_t offset, int whence) {
+    return fseek(file->fp, offset, whence) == 0 ? 0 : -errno;
+}
+
+struct packet {
+    const uint8_t *data;
+    size_t len;
+};
+
+static void write_page(FILE *f, uint8_t flags, int64_t granule, uint32_t sequence,
+                       const struct packet *packets, size_t count) {
+    uint8_t header[OGG_PAGE_HEADER_SIZE];
+    uint8_t lacing[OGG_MAX_SEGMENTS];
+    uint8_t nsegs = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t len = packets[i].len;
+        while (len >= 255) {
+            lacing[nsegs++] = 255;
+            len -= 255;
+        }
+        lacing[nsegs++] = len;
+    }
+
+    struct ogg_page_header hdr = {
+        .flags = flags,
+        .granule = granule,
+        .serial = 0x5354,
+        .sequence = sequence,
+        .segment_count = nsegs,
+    };
+    ogg_page_header_write(header, &hdr);
+
+    uint32_t crc = ogg_crc_update(0, header, sizeof(header));
+    crc = ogg_crc_update(crc, lacing, nsegs);
+    for (size_t i = 0; i < count; i++) crc = ogg_crc_update(crc, packets[i].data, packets[i].len);
+    ogg_write_le32(header + 22, crc);
+
+    fwrite(header, sizeof(header), 1, f);
+    fwrite(lacing, nsegs, 1, f);
+    for (size_t i = 0; i < count; i++) fwrite(packets[i].data, packets[i].len, 1, f);
+}
+
+static size_t add_comment(uint8_t *out, const char *name, const char *value) {
+    size_t len = strlen(name) + 1 + strlen(value);
+    ogg_write_le32(out, len);
+    sprintf((char *) out + 4, "%s=%s", name, value);
+    return 4 + len;
+}
+
+// Three 20 ms silent CELT frames behind the headers
+static int write_track(const char *path, const char *title, const char *artist, const char *album) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+
+    uint8_t head[OPUS_HEAD_MIN_SIZE] = {'O', 'p', 'u', 's', 'H', 'e', 'a', 'd', 1, 2, 0x38, 0x01, 0x80, 0xBB};
+    struct packet p = {head, sizeof(head)};
+    write_page(f, OGG_FLAG_BOS, 0, 0, &p, 1);
+
+    uint8_t tags[1024];
+    size_t len = 8;
+    memcpy(tags, "OpusTags", 8);
+    ogg_write_le32(tags + len, 4);
+    memcpy(tags + len + 4, "test", 4);
+    len += 8;
+    ogg_write_le32(tags + len, 3);
+    len += 4;
+    len += add_comment(tags + len, "TITLE", title);
+    len += add_comment(tags + len, "ARTIST", artist);
+    len += add_comment(tags + len, "ALBUM", album);
+    p = (struct packet) {tags, len};
+    write_page(f, 0, 0, 1, &p, 1);
+
+    static const uint8_t frame[] = {0xF8, 0xFF, 0xFE};
+    struct packet audio[3] = {{frame, sizeof(frame)}, {frame, sizeof(frame)}, {frame, sizeof(frame)}};
+    write_page(f, OGG_FLAG_EOS, 3 * 960, 2, audio, 3);
+
+    return fclose(f);
+}
+
+static const char *const words[] = {
+    "alpha", "amber", "apple", "blue", "bright", "carry", "city", "dawn", "deep", "echo",
+    "ever", "fall", "fire", "gold", "heart", "home", "iron", "jade", "june", "kite",
+    "last", "light", "moon", "night", "ocean", "over", "paper", "quiet", "rain", "river",
+    "shadow", "silver", "star", "summer", "tide", "under", "violet", "wave", "winter", "zero",
+    "あさ", "あめ", "いろ", "うた", "かぜ", "きみ", "さくら", "そら", "たび", "つき",
+    "なつ", "はな", "ひかり", "ほし", "まち", "ゆめ", "よる", "ｶﾞｯｺｳ", "ﾊﾟﾚｰﾄﾞ", "ﾊﾞﾗ",
+    "Ωmega", "Юность", "「夜」", "1999", "Ｆｕｌｌ",
+};
+
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+
+static uint32_t rng = 12345;
+
+static uint32_t next_random(void) {
+    rng = rng * 1103515245 + 12345;
+    return rng >> 8;
+}
+
+static int make_card(const char *cardprep, const char *work) {
+    char src[4096];
+    char card[4096];
+    char path[4200];
+    snprintf(src, sizeof(src), "%s/src", work);
+    snprintf(card, sizeof(card), "%s/card", work);
+    mkdir(work, 0755);
+    mkdir(src, 0755);
+    mkdir(card, 0755);
+
+    for (int i = 0; i < TRACKS; i++) {
+        char title[256];
+        char artist[64];
+        char album[64];
+        // Half start with "Song" so one jump bucket spans many blocks
+        snprintf(title, sizeof(title), "%s%s %s %d", i % 2 ? "Song " : "", words[next_random() % WORD_COUNT],
+                 words[next_random() % WORD_COUNT], i % 17);
+        snprintf(artist, sizeof(artist), "Artist %d", i % 97);
+        snprintf(album, sizeof(album), "Album %d", i % 211);
+        snprintf(path, sizeof(path), "%s/t%04d.opus", src, i);
+        if (write_track(path, title, artist, album) < 0) return -1;
+    }
+
+    char command[8600];
+    snprintf(command, sizeof(command), "\"%s\" \"%s\" \"%s\" > /dev/null", cardprep, src, card);
+    if (system(command) != 0) return -1;
+
+    host_fs_root = strdup(card);
+    return 0;
+}
+
+struct sorted {
+    uint8_t key[COLLATE_KEY_MAX];
+    size_t len;
+    uint32_t track;
+};
+
+static struct sorted titles[TRACKS];
+
+static int compare_keys(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0) return c;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+static int compare_sorted(const void *a, const void *b) {
+    const struct sorted *x = a;
+    const struct sorted *y = b;
+    int c = compare_keys(x->key, x->len, y->key, y->len);
+    if (c != 0) return c;
+    return (x->track > y->track) - (x->track < y->track);
+}
+
+// Expected order, built from the titles library.c reads back
+static void sort_titles(void) {
+    for (uint32_t i = 0; i < TRACKS; i++) {
+        struct library_index_entry entry;
+        char title[LIBRARY_PATH_MAX];
+        CHECK(library_get_entry(i, &entry) == 0);
+        CHECK(library_get_string(entry.title, title, sizeof(title)) >= 0);
+        titles[i].len = collate_key(title, titles[i].key, COLLATE_KEY_MAX);
+        titles[i].track = i;
+    }
+    qsort(titles, TRACKS, sizeof(titles[0]), compare_sorted);
+}
+
+static void walks_in_order(void) {
+    struct library_cursor cursor;
+    uint32_t track;
+
+    CHECK(library_sort_jump(LIBRARY_SORT_TITLE, 0, &cursor) == 0);
+    for (uint32_t pos = 0; pos < TRACKS; pos++) {
+        if (library_sort_next(&cursor, &track) != 0) {
+            CHECK(!"walk ended early");
+            return;
+        }
+        CHECK(track == titles[pos].track);
+    }
+    CHECK(library_sort_next(&cursor, &track) == -ENOENT);
+}
+
+static void seeks_by_position(void) {
+    for (uint32_t pos = 0; pos < TRACKS; pos += 7) {
+        struct library_cursor cursor;
+        uint32_t track;
+        uint32_t told;
+        CHECK(library_sort_seek(LIBRARY_SORT_TITLE, pos, &cursor) == 0);
+        CHECK(library_sort_tell(&cursor, &told) == 0 && told == pos);
+        CHECK(library_sort_next(&cursor, &track) == 0 && track == titles[pos].track);
+    }
+    struct library_cursor cursor;
+    CHECK(library_sort_seek(LIBRARY_SORT_TITLE, TRACKS, &cursor) == -ENOENT);
+}
+
+static void jumps_to_bucket_starts(void) {
+    uint32_t pos = 0;
+    for (int b = 0; b < COLLATE_JUMP_COUNT; b++) {
+        while (pos < TRACKS && collate_jump_bucket(titles[pos].key, titles[pos].len) < b) pos++;
+
+        struct library_cursor cursor;
+        uint32_t told;
+        CHECK(library_sort_jump(LIBRARY_SORT_TITLE, b, &cursor) == 0);
+        CHECK(library_sort_tell(&cursor, &told) == 0 && told == pos);
+    }
+}
+
+static uint32_t ceil_log2(uint32_t n) {
+    uint32_t bits = 0;
+    while ((1u << bits) < n) bits++;
+    return bits;
+}
+
+// A search binary searches the blocks of its jump bucket by their first key,
+// then reads the block it lands in and at most the one after
+static void finds_with_few_reads(const struct library_index_header *header) {
+    static const char *const queries[] = {
+        "", "a", "Apple", "apple fire", "ｓｔａｒ", "star zero 1", "zz", "0", "1999",
+        "song", "song a", "Song zero", "song ﾊﾞﾗ", "song 「", "songs",
+        "かぜ", "ｶｾﾞ", "がっこう", "ｶﾞｯｺｳ ", "はら", "ぱれ", "ﾊﾟﾚｰﾄﾞ", "ばら", "よる",
+        "Ω", "ωmega", "Ю", "「", "「夜」 moon", "ﾝ", "漢", "\xF0\x9F\x8E\xB5",
+    };
+    const struct library_sort_table *table = &header->sort[LIBRARY_SORT_TITLE];
+    uint32_t worst = 0;
+
+    for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]) + 200; q++) {
+        // The fixed queries, then prefixes of titles that are on the card
+        char text[COLLATE_KEY_MAX + 1];
+        if (q < sizeof(queries) / sizeof(queries[0])) {
+            snprintf(text, sizeof(text), "%s", queries[q]);
+        } else {
+            const struct sorted *t = &titles[next_random() % TRACKS];
+            size_t len = 1 + next_random() % t->len;
+            memcpy(text, t->key, len);
+            text[len] = '\0';
+        }
+
+        uint8_t key[COLLATE_KEY_MAX];
+        size_t key_len = collate_key(text, key, sizeof(key));
+        uint32_t expected = 0;
+        while (expected < TRACKS && compare_keys(titles[expected].key, titles[expected].len, key, key_len) < 0) {
+            expected++;
+        }
+        bool match = expected < TRACKS && titles[expected].len >= key_len
+                     && memcmp(titles[expected].key, key, key_len) == 0;
+
+        struct library_cursor cursor;
+        int rc = library_sort_find(LIBRARY_SORT_TITLE, text, &cursor);
+        CHECK(rc == (match ? 0 : -ENOENT));
+
+        uint32_t told;
+        if (library_sort_tell(&cursor, &told) == 0 && expected < TRACKS && told != expected) {
+            fprintf(stderr, "find '%s' at %u, expected %u\n", text, told, expected);
+            failures++;
+        }
+
+        int bucket = collate_jump_bucket(key, key_len);
+        uint32_t lo = table->jump[bucket].block;
+        uint32_t hi = bucket + 1 < COLLATE_JUMP_COUNT ? table->jump[bucket + 1].block : table->block_count;
+        uint32_t span = hi >= lo ? hi - lo + 1 : 1;
+        uint32_t reads = library_sort_find_reads();
+        if (reads > ceil_log2(span) + 2) {
+            fprintf(stderr, "find '%s' read %u blocks of a %u block bucket\n", text, reads, span);
+            failures++;
+        }
+        if (reads > worst) worst = reads;
+    }
+
+    printf("%u title blocks, a search read at most %u\n", table->block_count, worst);
+    CHECK(worst <= ceil_log2(table->block_count) + 2);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <cardprep> <work dir>\n", argv[0]);
+        return 2;
+    }
+    if (make_card(argv[1], argv[2]) < 0) {
+        fprintf(stderr, "Failed to build the card in %s\n", argv[2]);
+        return 1;
+    }
+
+    CHECK(library_open() == 0);
+    CHECK(library_count() == TRACKS);
+    if (failures) return 1;
+
+    struct library_index_header header;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/" LIBRARY_INDEX_NAME, host_fs_root);
+    FILE *f = fopen(path, "rb");
+    CHECK(f && fread(&header, sizeof(header), 1, f) == 1);
+    if (f) fclose(f);
+
+    sort_titles();
+    walks_in_order();
+    seeks_by_position();
+    jumps_to_bucket_starts();
+    finds_with_few_reads(&header);
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("library index ok\n");
+    return 0;
+}
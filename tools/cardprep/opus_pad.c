@@ -0,0 +1,153 @@
+#include "opus_pad.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#define OPUS_MAX_FRAMES 48
+#define OPUS_MAX_FRAME_BYTES 1275
+
+static int read_size(const uint8_t *data, size_t len, uint16_t *size) {
+    if (len < 1) return -1;
+    if (data[0] < 252) {
+        *size = data[0];
+        return 1;
+    }
+    if (len < 2) return -1;
+    *size = 4 * data[1] + data[0];
+    return 2;
+}
+
+static int write_size(uint8_t *out, uint16_t size) {
+    if (size < 252) {
+        out[0] = size;
+        return 1;
+    }
+    out[0] = 252 + (size & 3);
+    out[1] = (size - out[0]) >> 2;
+    return 2;
+}
+
+// Splits a packet into frames following RFC 6716 3.2, padding is dropped
+static int parse_frames(const uint8_t *data, size_t len, const uint8_t **frames, uint16_t *sizes) {
+    if (len < 1) return -1;
+
+    uint8_t toc = data[0];
+    size_t pos = 1;
+    int count;
+    int n;
+
+    switch (toc & 3) {
+        case 0:
+            count = 1;
+            sizes[0] = len - pos;
+        break;
+        case 1:
+            if ((len - pos) & 1) return -1;
+            count = 2;
+            sizes[0] = sizes[1] = (len - pos) / 2;
+        break;
+        case 2:
+            count = 2;
+            n = read_size(data + pos, len - pos, &sizes[0]);
+            if (n < 0) return -1;
+            pos += n;
+            if (sizes[0] > len - pos) return -1;
+            sizes[1] = len - pos - sizes[0];
+        break;
+        default: {
+            if (len < 2) return -1;
+            uint8_t ch = data[pos++];
+            count = ch & 0x3F;
+            if (count == 0 || count > OPUS_MAX_FRAMES) return -1;
+
+            size_t padding = 0;
+            if (ch & 0x40) {
+                uint8_t b;
+                do {
+                    if (pos >= len) return -1;
+                    b = data[pos++];
+                    padding += b == 255 ? 254 : b;
+                } while (b == 255);
+            }
+            if (padding > len - pos) return -1;
+            size_t avail = len - pos - padding;
+
+            if (ch & 0x80) {
+                size_t total = 0;
+                for (int i = 0; i < count - 1; i++) {
+                    n = read_size(data + pos, avail, &sizes[i]);
+                    if (n < 0) return -1;
+                    pos += n;
+                    avail -= n;
+                    total += sizes[i];
+                }
+                if (total > avail) return -1;
+                sizes[count - 1] = avail - total;
+            } else {
+                if (avail % count) return -1;
+                for (int i = 0; i < count; i++) sizes[i] = avail / count;
+            }
+        }
+        break;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (sizes[i] > OPUS_MAX_FRAME_BYTES) return -1;
+        frames[i] = data + pos;
+        pos += sizes[i];
+    }
+    return count;
+}
+
+int opus_pad_to(const uint8_t *in, size_t len, uint8_t *out, size_t new_len) {
+    const uint8_t *frames[OPUS_MAX_FRAMES];
+    uint16_t sizes[OPUS_MAX_FRAMES];
+    int count = parse_frames(in, len, frames, sizes);
+    if (count < 0) return -1;
+
+    bool vbr = false;
+    size_t data_len = sizes[0];
+    for (int i = 1; i < count; i++) {
+        if (sizes[i] != sizes[0]) vbr = true;
+        data_len += sizes[i];
+    }
+
+    uint8_t size_bytes[2 * OPUS_MAX_FRAMES];
+    size_t size_len = 0;
+    if (vbr) {
+        for (int i = 0; i < count - 1; i++) {
+            size_len += write_size(size_bytes + size_len, sizes[i]);
+        }
+    }
+
+    size_t fixed = 2 + size_len + data_len;
+    if (new_len < fixed + 1) return -1;
+
+    // Split what's left into k length bytes and the padding they describe
+    size_t remain = new_len - fixed;
+    size_t k = 1;
+    size_t padding;
+    while (1) {
+        if (k > remain) return -1;
+        padding = remain - k;
+        if (padding <= 254 * k) break;
+        k++;
+    }
+    if (padding < 254 * (k - 1)) return -1;
+
+    size_t pos = 0;
+    out[pos++] = in[0] | 3;
+    out[pos++] = (vbr ? 0x80 : 0) | 0x40 | count;
+    for (size_t i = 0; i < k - 1; i++) out[pos++] = 255;
+    out[pos++] = padding - 254 * (k - 1);
+    memcpy(out + pos, size_bytes, size_len);
+    pos += size_len;
+
+    // Frames are gathered from the input in order, out must not alias in
+    for (int i = 0; i < count; i++) {
+        memcpy(out + pos, frames[i], sizes[i]);
+        pos += sizes[i];
+    }
+    memset(out + pos, 0, padding);
+    return (int)(pos + padding);
+}
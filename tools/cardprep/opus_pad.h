@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Rewrites an Opus packet as a code 3 packet padded to exactly new_len bytes.
+// The decoded audio is unchanged. Returns new_len or -1 if it can't be done.
+int opus_pad_to(const uint8_t *in, size_t len, uint8_t *out, size_t new_len);
+
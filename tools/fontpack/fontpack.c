@@ -0,0 +1,292 @@
+// Host side tool that converts Unicode BDF bitmap fonts into the font file the
+// player streams glyphs from (see include/font_file.h).
+//
+//   fontpack -o <card dir>/GLYPHS.STF <font.bdf> [more.bdf ...]
+//
+// Fonts are merged in order, the first one to define a codepoint wins, so a
+// Latin font can be listed before a CJK one to take over ASCII.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "font_file.h"
+
+struct glyph {
+    uint32_t codepoint;
+    uint32_t order; // Load order, breaks ties between fonts
+    uint8_t adv_w;
+    uint8_t box_w;
+    uint8_t box_h;
+    int8_t ofs_x;
+    int8_t ofs_y;
+    uint8_t bitmap[FONT_MAX_GLYPH_BYTES];
+};
+
+struct font {
+    struct glyph *glyphs;
+    size_t count;
+    size_t cap;
+    int ascent;
+    int descent;
+};
+
+static void write_le32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void *xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int load_bdf(const char *path, struct font *font) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[1024];
+    char registry[64] = "";
+    struct glyph g;
+    int encoding = -1;
+    int bbx_w = 0, bbx_h = 0, bbx_x = 0, bbx_y = 0;
+    int adv = 0;
+    int row = -1;
+    bool usable = false;
+    size_t added = 0, skipped = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (row >= 0) {
+            if (strncmp(line, "ENDCHAR", 7) == 0) {
+                if (usable && row == bbx_h) {
+                    font->glyphs = font->count == font->cap
+                        ? xrealloc(font->glyphs, (font->cap = font->cap ? font->cap * 2 : 1024) * sizeof(g))
+                        : font->glyphs;
+                    g.order = font->count;
+                    font->glyphs[font->count++] = g;
+                    added++;
+                } else {
+                    skipped++;
+                }
+                row = -1;
+                continue;
+            }
+            if (!usable || row >= bbx_h) continue;
+
+            size_t row_bytes = (bbx_w + 7) / 8;
+            for (size_t i = 0; i < row_bytes; i++) {
+                int hi = hex_value(line[2 * i]);
+                int lo = hex_value(line[2 * i + 1]);
+                if (hi < 0 || lo < 0) {
+                    usable = false;
+                    break;
+                }
+                g.bitmap[row * row_bytes + i] = (hi << 4) | lo;
+            }
+            row++;
+        } else if (sscanf(line, "CHARSET_REGISTRY \"%63[^\"]\"", registry) == 1) {
+        } else if (sscanf(line, "FONT_ASCENT %d", &font->ascent) == 1) {
+        } else if (sscanf(line, "FONT_DESCENT %d", &font->descent) == 1) {
+        } else if (strncmp(line, "STARTCHAR", 9) == 0) {
+            encoding = -1;
+            adv = 0;
+            bbx_w = bbx_h = 0;
+        } else if (sscanf(line, "ENCODING %d", &encoding) == 1) {
+        } else if (sscanf(line, "DWIDTH %d", &adv) == 1) {
+        } else if (sscanf(line, "BBX %d %d %d %d", &bbx_w, &bbx_h, &bbx_x, &bbx_y) == 4) {
+        } else if (strncmp(line, "BITMAP", 6) == 0) {
+            memset(&g, 0, sizeof(g));
+            usable = encoding >= 0 && adv >= 0 && adv <= 255
+                && bbx_w >= 0 && bbx_w <= FONT_MAX_GLYPH_DIM && bbx_h >= 0 && bbx_h <= FONT_MAX_GLYPH_DIM
+                && bbx_x >= INT8_MIN && bbx_x <= INT8_MAX && bbx_y >= INT8_MIN && bbx_y <= INT8_MAX;
+            g.codepoint = encoding;
+            g.adv_w = adv;
+            g.box_w = bbx_w;
+            g.box_h = bbx_h;
+            g.ofs_x = bbx_x;
+            g.ofs_y = bbx_y;
+            row = 0;
+        }
+    }
+    fclose(f);
+
+    if (strcasecmp(registry, "ISO10646") != 0) {
+        fprintf(stderr, "%s: charset is \"%s\", only ISO10646 (Unicode) fonts are supported\n", path, registry);
+        return -1;
+    }
+    printf("%s: %zu glyphs, %zu skipped\n", path, added, skipped);
+    return 0;
+}
+
+// By codepoint, the first font to define a glyph comes first
+static int compare_glyphs(const void *a, const void *b) {
+    const struct glyph *ga = a;
+    const struct glyph *gb = b;
+    if (ga->codepoint != gb->codepoint) return ga->codepoint < gb->codepoint ? -1 : 1;
+    return ga->order < gb->order ? -1 : 1;
+}
+
+static uint8_t common_advance(const struct glyph *glyphs, size_t count) {
+    size_t hist[256] = {0};
+    size_t cjk = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (glyphs[i].codepoint >= 0x2E80) cjk++;
+    }
+    // Glyphs waiting to load are mostly CJK, size the blank for those
+    for (size_t i = 0; i < count; i++) {
+        if (cjk == 0 || glyphs[i].codepoint >= 0x2E80) hist[glyphs[i].adv_w]++;
+    }
+
+    uint8_t best = 0;
+    for (int i = 1; i < 256; i++) {
+        if (hist[i] > hist[best]) best = i;
+    }
+    return best;
+}
+
+static int write_font(const char *path, struct font *font) {
+    // Merge, keeping the first definition of every codepoint
+    qsort(font->glyphs, font->count, sizeof(struct glyph), compare_glyphs);
+    size_t count = 0;
+    for (size_t i = 0; i < font->count; i++) {
+        if (count > 0 && font->glyphs[count - 1].codepoint == font->glyphs[i].codepoint) continue;
+        font->glyphs[count++] = font->glyphs[i];
+    }
+    if (count == 0) {
+        fprintf(stderr, "No glyphs\n");
+        return -1;
+    }
+
+    size_t page_count = (count + FONT_GLYPHS_PER_PAGE - 1) / FONT_GLYPHS_PER_PAGE;
+    uint32_t pages_offset = sizeof(struct font_file_header);
+    uint32_t index_offset = pages_offset + page_count * sizeof(uint32_t);
+    index_offset = (index_offset + CARD_SECTOR_SIZE - 1) / CARD_SECTOR_SIZE * CARD_SECTOR_SIZE;
+    // Whole pages, the player always reads a full sector
+    uint32_t bitmaps_offset = index_offset + page_count * CARD_SECTOR_SIZE;
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct font_file_header header = {0};
+    memcpy(header.magic, FONT_FILE_MAGIC, 4);
+    header.version = FONT_FILE_VERSION;
+    header.bpp = 1;
+    header.line_height = font->ascent + font->descent;
+    header.base_line = font->descent;
+    header.default_adv = common_advance(font->glyphs, count);
+    header.glyph_count = count;
+    header.pages_offset = pages_offset;
+    header.index_offset = index_offset;
+    header.bitmaps_offset = bitmaps_offset;
+    fwrite(&header, sizeof(header), 1, f);
+
+    for (size_t p = 0; p < page_count; p++) {
+        uint8_t first[4];
+        write_le32(first, font->glyphs[p * FONT_GLYPHS_PER_PAGE].codepoint);
+        fwrite(first, 4, 1, f);
+    }
+
+    uint8_t zero[CARD_SECTOR_SIZE] = {0};
+    fwrite(zero, index_offset - ftell(f), 1, f);
+
+    uint32_t bitmap = 0;
+    for (size_t i = 0; i < page_count * FONT_GLYPHS_PER_PAGE; i++) {
+        struct font_file_glyph entry = {0};
+        if (i < count) {
+            const struct glyph *g = &font->glyphs[i];
+            entry.codepoint = g->codepoint;
+            entry.bitmap = bitmap;
+            entry.adv_w = g->adv_w;
+            entry.box_w = g->box_w;
+            entry.box_h = g->box_h;
+            entry.ofs_x = g->ofs_x;
+            entry.ofs_y = g->ofs_y;
+            bitmap += g->box_h * ((g->box_w + 7) / 8);
+        }
+        fwrite(&entry, sizeof(entry), 1, f);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const struct glyph *g = &font->glyphs[i];
+        fwrite(g->bitmap, g->box_h * ((g->box_w + 7) / 8), 1, f);
+    }
+
+    bool ok = !ferror(f);
+    ok &= fclose(f) == 0;
+    if (!ok) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return -1;
+    }
+
+    printf("Wrote %zu glyphs, %zu bytes of bitmaps, %u px lines\n", count, (size_t) bitmap, header.line_height);
+    return 0;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s -o <output> <font.bdf> [more.bdf ...]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    const char *out = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:h")) != -1) {
+        switch (opt) {
+            case 'o':
+                out = optarg;
+            break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (!out || optind == argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct font font = {0};
+    for (int i = optind; i < argc; i++) {
+        int ascent = font.ascent;
+        int descent = font.descent;
+        if (load_bdf(argv[i], &font) < 0) return 1;
+
+        // Line metrics come from the first font
+        if (i > optind) {
+            font.ascent = ascent;
+            font.descent = descent;
+        }
+    }
+
+    if (font.ascent + font.descent <= 0 || font.ascent + font.descent > 255) {
+        fprintf(stderr, "Missing or invalid FONT_ASCENT / FONT_DESCENT\n");
+        return 1;
+    }
+
+    int rc = write_font(out, &font);
+    free(font.glyphs);
+    return rc < 0 ? 1 : 0;
+}
@@ -0,0 +1,166 @@
+// Replays a recorded decode load trace through the clock governor policy and
+// reports the energy / deadline miss tradeoff for a sweep of thresholds.
+//
+//   govsim [-f mhz] [-s static_ma] [-r run_ua_per_mhz] [-i sleep_ua_per_mhz] <trace>
+//
+// The trace is the device output with GOVERNOR_TRACE enabled, lines of
+// "gov,<work_us>,<block_us>,<in_flight>,<level>". Other lines are ignored.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "governor_policy.h"
+
+struct block {
+    uint32_t full_work_us; // Work normalised to full speed
+    uint32_t block_us;
+};
+
+struct power_model {
+    double full_mhz;
+    double static_ma;
+    double run_ua_per_mhz;
+    double sleep_ua_per_mhz;
+};
+
+struct result {
+    double avg_ma;
+    uint32_t misses;
+    uint32_t level_blocks[GOV_LEVEL_COUNT];
+};
+
+static struct block *load_trace(const char *path, size_t *count) {
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+
+    struct block *blocks = NULL;
+    size_t cap = 0;
+    char line[256];
+    *count = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        char *start = strstr(line, "gov,");
+        unsigned work, period, in_flight, level;
+        if (!start || sscanf(start, "gov,%u,%u,%u,%u", &work, &period, &in_flight, &level) != 4) continue;
+        if (level >= GOV_LEVEL_COUNT) continue;
+
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            blocks = realloc(blocks, cap * sizeof(*blocks));
+            if (!blocks) {
+                fclose(f);
+                return NULL;
+            }
+        }
+        blocks[*count].full_work_us = work / gov_dividers[level];
+        blocks[*count].block_us = period;
+        (*count)++;
+    }
+
+    fclose(f);
+    return blocks;
+}
+
+static double block_charge(const struct power_model *pm, uint8_t level, uint32_t work_us, uint32_t block_us) {
+    double mhz = pm->full_mhz / gov_dividers[level];
+    double run_ma = pm->static_ma + pm->run_ua_per_mhz * mhz / 1000.0;
+    double sleep_ma = pm->static_ma + pm->sleep_ua_per_mhz * mhz / 1000.0;
+    uint32_t busy = work_us < block_us ? work_us : block_us;
+    return run_ma * busy + sleep_ma * (block_us - busy);
+}
+
+// With two DMA blocks the next one has to be ready within one block period
+static void simulate(const struct block *blocks, size_t count, const struct gov_config *cfg,
+                     bool fixed, const struct power_model *pm, struct result *res) {
+    struct gov_state st;
+    gov_init(&st, cfg);
+    memset(res, 0, sizeof(*res));
+
+    uint8_t level = 0;
+    double charge = 0;
+    double total_us = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t work = blocks[i].full_work_us * gov_dividers[level];
+        uint32_t in_flight = work > blocks[i].block_us ? 0 : 1;
+        if (in_flight == 0) res->misses++;
+        res->level_blocks[level]++;
+
+        charge += block_charge(pm, level, work, blocks[i].block_us);
+        total_us += blocks[i].block_us;
+
+        if (!fixed) level = gov_update(&st, work, blocks[i].block_us, in_flight);
+    }
+
+    res->avg_ma = total_us > 0 ? charge / total_us : 0;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-f mhz] [-s static_ma] [-r run_ua_per_mhz] [-i sleep_ua_per_mhz] <trace>\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    // Rough STM32U585 figures with the SMPS, override to match measurements
+    struct power_model pm = {
+        .full_mhz = 160,
+        .static_ma = 1.0,
+        .run_ua_per_mhz = 19.5,
+        .sleep_ua_per_mhz = 6.0,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:s:r:i:h")) != -1) {
+        switch (opt) {
+            case 'f': pm.full_mhz = atof(optarg); break;
+            case 's': pm.static_ma = atof(optarg); break;
+            case 'r': pm.run_ua_per_mhz = atof(optarg); break;
+            case 'i': pm.sleep_ua_per_mhz = atof(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t count;
+    struct block *blocks = load_trace(argv[optind], &count);
+    if (!blocks || count == 0) {
+        fprintf(stderr, "No trace lines in %s\n", argv[optind]);
+        return 1;
+    }
+
+    struct gov_config def = GOV_CONFIG_DEFAULT;
+    struct result fixed;
+    simulate(blocks, count, &def, true, &pm, &fixed);
+
+    printf("%zu blocks\n", count);
+    printf("%-22s %9s %8s %7s  %s\n", "policy", "avg mA", "saving", "misses", "residency (full/half/quarter)");
+    printf("%-22s %9.3f %7.1f%% %7u  %u/%u/%u\n", "fixed full speed", fixed.avg_ma, 0.0, fixed.misses,
+           fixed.level_blocks[0], fixed.level_blocks[1], fixed.level_blocks[2]);
+
+    static const uint16_t up_loads[] = {5000, 6500, 8000, 9000};
+    for (size_t i = 0; i < sizeof(up_loads) / sizeof(up_loads[0]); i++) {
+        struct gov_config cfg = def;
+        cfg.up_load = up_loads[i];
+        cfg.down_load = up_loads[i] * def.down_load / def.up_load;
+
+        struct result res;
+        simulate(blocks, count, &cfg, false, &pm, &res);
+
+        char name[32];
+        snprintf(name, sizeof(name), "up %u%% down %u%%%s", cfg.up_load / 100, cfg.down_load / 100,
+                 cfg.up_load == def.up_load ? " *" : "");
+        printf("%-22s %9.3f %7.1f%% %7u  %u/%u/%u\n", name, res.avg_ma,
+               100.0 * (fixed.avg_ma - res.avg_ma) / fixed.avg_ma, res.misses,
+               res.level_blocks[0], res.level_blocks[1], res.level_blocks[2]);
+    }
+
+    free(blocks);
+    return 0;
+}
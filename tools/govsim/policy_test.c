@@ -0,0 +1,127 @@
+// Checks the clock governor's decisions on synthetic loads. Run with ctest
+// after building tools/govsim.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "governor_policy.h"
+
+#define BLOCK_US 60000
+
+static int failures;
+
+#define CHECK(cond)                                                       \
+    do {                                                                  \
+        if (!(cond)) {                                                    \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                   \
+        }                                                                 \
+    } while (0)
+
+// Feeds n blocks of block_us costing full_work_us at full speed, measured at
+// whatever level the governor picked, the way the audio thread reports them
+static uint8_t feed_blocks(struct gov_state *st, uint32_t full_work_us, uint32_t block_us, uint32_t n) {
+    uint8_t level = st->level;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t work = full_work_us * gov_dividers[level];
+        level = gov_update(st, work, block_us, work > block_us ? 0 : 1);
+    }
+    return level;
+}
+
+static uint8_t feed(struct gov_state *st, uint32_t full_work_us, uint32_t n) {
+    return feed_blocks(st, full_work_us, BLOCK_US, n);
+}
+
+static void steps_down_after_hold(void) {
+    struct gov_config cfg = GOV_CONFIG_DEFAULT;
+    struct gov_state st;
+    gov_init(&st, &cfg);
+
+    // 10ms of work per 60ms block is 17%, 33% at half speed and 67% at quarter
+    CHECK(feed(&st, 10000, cfg.hold_blocks - 1) == 0);
+    CHECK(feed(&st, 10000, 1) == 1);
+    // Quarter speed would cross up_load, so it must never be entered
+    CHECK(feed(&st, 10000, 1000) == 1);
+    CHECK(st.misses == 0);
+}
+
+static void steps_up_at_once(void) {
+    struct gov_config cfg = GOV_CONFIG_DEFAULT;
+    struct gov_state st;
+    gov_init(&st, &cfg);
+
+    CHECK(feed(&st, 5000, 2 * cfg.hold_blocks) == 2);
+    // 12ms at full speed projects to 80% at quarter and 40% at half speed,
+    // half speed is taken straight away without stepping through levels
+    CHECK(feed(&st, 12000, 1) == 1);
+    CHECK(st.misses == 0);
+}
+
+static void dry_dma_goes_to_full_speed(void) {
+    struct gov_config cfg = GOV_CONFIG_DEFAULT;
+    struct gov_state st;
+    gov_init(&st, &cfg);
+
+    CHECK(feed(&st, 5000, 2 * cfg.hold_blocks) == 2);
+    CHECK(gov_update(&st, 5000 * gov_dividers[2], BLOCK_US, 0) == 0);
+    CHECK(st.misses == 1);
+}
+
+static void holds_between_thresholds(void) {
+    struct gov_config cfg = GOV_CONFIG_DEFAULT;
+    struct gov_state st;
+    gov_init(&st, &cfg);
+
+    // 30% at full speed is 60% at half, between down_load and up_load
+    CHECK(feed(&st, 18000, 2000) == 0);
+    CHECK(st.level_blocks[1] == 0 && st.level_blocks[2] == 0);
+}
+
+static void spike_holds_full_speed(void) {
+    struct gov_config cfg = GOV_CONFIG_DEFAULT;
+    struct gov_state st;
+    gov_init(&st, &cfg);
+
+    CHECK(feed(&st, 10000, 2 * cfg.hold_blocks) == 1);
+    CHECK(feed(&st, 25000, 1) == 0);
+    // The decaying peak keeps it at full speed for longer than the hold alone
+    CHECK(feed(&st, 10000, cfg.hold_blocks) == 0);
+    CHECK(feed(&st, 10000, 1000) == 1);
+    CHECK(st.misses == 0);
+}
+
+// Default opusenc streams decode to 20ms blocks. The same per packet work is
+// three times the load it would be against a 60ms period.
+static void short_blocks(void) {
+    struct gov_config cfg = GOV_CONFIG_DEFAULT;
+    struct gov_state st;
+    gov_init(&st, &cfg);
+
+    // 6ms per 20ms block is 30%, 60% at half speed, so it stays at full speed
+    CHECK(feed_blocks(&st, 6000, 20000, 2000) == 0);
+    CHECK(st.level_blocks[1] == 0 && st.level_blocks[2] == 0);
+    CHECK(st.misses == 0);
+
+    // 3.3ms per 20ms block steps down to half speed but never to quarter
+    gov_init(&st, &cfg);
+    CHECK(feed_blocks(&st, 3300, 20000, 2000) == 1);
+    CHECK(st.level_blocks[2] == 0);
+    CHECK(st.misses == 0);
+}
+
+int main(void) {
+    steps_down_after_hold();
+    steps_up_at_once();
+    dry_dma_goes_to_full_speed();
+    holds_between_thresholds();
+    spike_holds_full_speed();
+    short_blocks();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("governor policy ok\n");
+    return 0;
+}
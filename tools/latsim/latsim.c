@@ -0,0 +1,224 @@
+// Runs the audio thread's block loop (src/transport.c) in virtual time
+// against the transport latency probe and checks every PAUSE, RESUME and NEXT
+// against the bound. The DMA, the command pipe and the decoder are simulated,
+// the scheduling is the code the target runs. Run with ctest.
+//
+//   latsim [seed]
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "latency_probe.h"
+#include "transport.h"
+
+#define BLOCK_US       60000 // SAMPLE_NO at 48kHz
+#define SHORT_BLOCK_US 20000 // A packet from a default opusenc stream
+#define PAUSE_BLOCK_US 10000 // PAUSE_BLOCK_SAMPLES
+#define NUM_BLOCKS     2
+#define COMMANDS       20000
+// One packet in this many ends its track
+#define TRACK_PACKETS  300
+
+enum command {PAUSE, RESUME, NEXT};
+
+struct sent {
+    int64_t us;
+    enum command type;
+};
+
+struct sim {
+    struct transport transport;
+    struct sent commands[COMMANDS];
+    int next;
+    int64_t now;
+
+    // Blocks owned by the DMA, by the time each one finishes playing
+    int64_t end[NUM_BLOCKS];
+    int len;
+    // Slots handed to the loop and not queued or given back yet
+    int held;
+
+    // Packets decoded since the track started
+    uint32_t track_packets;
+
+    uint32_t silence_blocks;
+    uint32_t dropped;
+    uint32_t tracks;
+};
+
+static struct latency_probe probe;
+static uint32_t measured;
+static uint32_t over_bound;
+static uint32_t errors;
+
+static void check(uint32_t latency_us) {
+    measured++;
+    if (latency_us > LATENCY_BOUND_US(BLOCK_US)) {
+        fprintf(stderr, "latency %u us over the %u us bound\n", latency_us, LATENCY_BOUND_US(BLOCK_US));
+        over_bound++;
+    }
+}
+
+static uint32_t random_between(uint32_t lo, uint32_t hi) {
+    return lo + (uint32_t) rand() % (hi - lo + 1);
+}
+
+// Like play_clock_sync, blocks are only seen to finish when the thread looks
+static void sync(struct sim *sim) {
+    uint32_t latency_us;
+    while (sim->len > 0 && sim->end[0] <= sim->now) {
+        for (int i = 1; i < sim->len; i++) sim->end[i - 1] = sim->end[i];
+        sim->len--;
+        if (latency_probe_block_played(&probe, sim->now, &latency_us)) check(latency_us);
+    }
+}
+
+static void push(struct sim *sim, uint32_t duration_us) {
+    int64_t start = sim->len > 0 ? sim->end[sim->len - 1] : sim->now;
+    sim->end[sim->len++] = start + duration_us;
+    sim->held--;
+}
+
+// k_mem_slab_alloc with K_FOREVER, sleeps until the oldest block has played
+static void *slot_acquire(void *ctx) {
+    struct sim *sim = ctx;
+    if (sim->len + sim->held == NUM_BLOCKS) {
+        if (sim->len == 0) {
+            fprintf(stderr, "every slot held by the loop\n");
+            errors++;
+            return NULL;
+        }
+        sim->now = sim->end[0];
+    }
+    sync(sim);
+    sim->held++;
+    return sim;
+}
+
+static void slot_release(void *ctx, void *slot) {
+    struct sim *sim = ctx;
+    (void) slot;
+    sim->held--;
+}
+
+static bool command(void *ctx, bool wait) {
+    struct sim *sim = ctx;
+    if (sim->next == COMMANDS) return false;
+
+    struct sent *cmd = &sim->commands[sim->next];
+    if (cmd->us > sim->now) {
+        if (!wait) return false;
+        sim->now = cmd->us;
+    }
+    sim->next++;
+
+    switch (cmd->type) {
+        case PAUSE:
+            if (transport_pause(&sim->transport)) {
+                latency_probe_command(&probe, cmd->us);
+            }
+        break;
+        case RESUME:
+            if (transport_resume(&sim->transport) == TRANSPORT_RESUME_FADE_IN) {
+                latency_probe_command(&probe, cmd->us);
+            }
+        break;
+        case NEXT:
+            // A skip cuts over behind the queued blocks with a fade in
+            latency_probe_command(&probe, cmd->us);
+            transport_start(&sim->transport, true);
+            sim->track_packets = 0;
+        break;
+    }
+    return true;
+}
+
+static int silence(void *ctx, void *slot) {
+    struct sim *sim = ctx;
+    (void) slot;
+    sim->now += random_between(50, 500);
+    sync(sim);
+    push(sim, PAUSE_BLOCK_US);
+    sim->silence_blocks++;
+    return 0;
+}
+
+static int audio(void *ctx, void *slot, enum transport_fade fade, bool *end) {
+    struct sim *sim = ctx;
+    uint32_t latency_us;
+    (void) slot;
+    (void) fade;
+
+    // Card read plus decode, up to 75% of the block at the lowest clock. A
+    // new track starts at full speed.
+    uint32_t block_us = rand() % 2 ? BLOCK_US : SHORT_BLOCK_US;
+    uint32_t divider = sim->track_packets++ < 2 ? 4 : 1;
+    sim->now += random_between(block_us / 20, block_us * 3 / 4) / divider;
+    sync(sim);
+    *end = rand() % TRACK_PACKETS == 0;
+
+    // The start of a track wholly inside the pre-skip or seek pre-roll
+    if (sim->track_packets <= 2 && rand() % 2 == 0) {
+        sim->held--;
+        sim->dropped++;
+        return 0;
+    }
+
+    push(sim, block_us);
+    if (latency_probe_response(&probe, sim->len - 1, sim->now, &latency_us)) check(latency_us);
+    return 1;
+}
+
+static void packet_done(void *ctx, bool end) {
+    struct sim *sim = ctx;
+    if (end) {
+        sim->tracks++;
+        sim->track_packets = 0;
+        transport_start(&sim->transport, false);
+    }
+}
+
+static const struct transport_ops ops = {
+    .slot_acquire = slot_acquire,
+    .slot_release = slot_release,
+    .command = command,
+    .silence = silence,
+    .audio = audio,
+    .packet_done = packet_done,
+};
+
+int main(int argc, char **argv) {
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    latency_probe_init(&probe);
+
+    static struct sim sim;
+    transport_init(&sim.transport);
+
+    // Commands at random times, some in bursts closer together than a block
+    int64_t t = 0;
+    for (int i = 0; i < COMMANDS; i++) {
+        t += rand() % 4 == 0 ? random_between(1, 20000) : random_between(1, 400000);
+        sim.commands[i].us = t;
+        sim.commands[i].type = (enum command) (rand() % 3);
+    }
+
+    // Prefilled with silence like start_i2s_dma
+    sim.held = NUM_BLOCKS;
+    push(&sim, BLOCK_US);
+    push(&sim, BLOCK_US);
+    transport_start(&sim.transport, false);
+
+    while (sim.next < COMMANDS && errors == 0) {
+        transport_step(&sim.transport, &ops, &sim);
+    }
+
+    printf("%u responses measured, worst %u us, bound %u us, %u tracks, %u pause blocks, %u packets dropped\n",
+           measured, probe.worst_us, LATENCY_BOUND_US(BLOCK_US), sim.tracks, sim.silence_blocks, sim.dropped);
+    if (over_bound > 0 || errors > 0 || measured < COMMANDS / 4 || sim.silence_blocks == 0 || sim.dropped == 0) {
+        fprintf(stderr, "%u over bound, %u errors\n", over_bound, errors);
+        return 1;
+    }
+    return 0;
+}
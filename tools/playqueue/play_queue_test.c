@@ -0,0 +1,186 @@
+// Checks the play queue's order: every shuffle is a permutation of the
+// library, a cycle never repeats a track, and prev, next, jump and peek agree
+// with each other across the reshuffle at the end of a cycle. Run with ctest.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "play_queue.h"
+
+static int failures;
+
+#define CHECK(cond)                                                       \
+    do {                                                                  \
+        if (!(cond)) {                                                    \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                   \
+        }                                                                 \
+    } while (0)
+
+static const uint32_t sizes[] = {1, 2, 3, 5, 7, 17, 100, 255, 257, 1000, 3000, 4096};
+#define SIZE_COUNT (sizeof(sizes) / sizeof(sizes[0]))
+
+// Plays one whole cycle from the current track, checking each track comes up
+// exactly once. Leaves the queue at the start of the next cycle.
+static void check_cycle(struct play_queue *q, uint32_t *order) {
+    uint32_t n = q->count;
+    uint8_t *seen = calloc(n, 1);
+
+    uint32_t id = play_queue_current(q);
+    for (uint32_t i = 0; i < n; i++) {
+        CHECK(id < n);
+        if (id >= n) break;
+        CHECK(!seen[id]);
+        seen[id] = 1;
+        if (order) order[i] = id;
+        CHECK(play_queue_next(q, &id));
+    }
+    for (uint32_t i = 0; i < n; i++) CHECK(seen[i]);
+    free(seen);
+}
+
+static void shuffle_is_a_permutation(void) {
+    for (size_t s = 0; s < SIZE_COUNT; s++) {
+        for (uint32_t seed = 1; seed <= 4; seed++) {
+            struct play_queue q;
+            play_queue_init(&q, sizes[s]);
+            play_queue_set_shuffle(&q, true, seed * 2654435761u);
+            check_cycle(&q, NULL);
+            // The reshuffled cycle after the wrap is one too
+            check_cycle(&q, NULL);
+        }
+    }
+}
+
+static void unshuffled_plays_in_order(void) {
+    struct play_queue q;
+    play_queue_init(&q, 10);
+    play_queue_jump(&q, 7);
+
+    uint32_t id;
+    for (uint32_t i = 1; i <= 10; i++) {
+        CHECK(play_queue_next(&q, &id));
+        CHECK(id == (7 + i) % 10);
+    }
+}
+
+static void shuffle_keeps_current(void) {
+    struct play_queue q;
+    play_queue_init(&q, 3000);
+    play_queue_jump(&q, 1234);
+
+    play_queue_set_shuffle(&q, true, 99);
+    CHECK(play_queue_current(&q) == 1234);
+    play_queue_set_shuffle(&q, false, 0);
+    CHECK(play_queue_current(&q) == 1234);
+}
+
+// peek(k) must name the track k nexts would reach, including past the wrap
+static void peek_matches_next(void) {
+    for (size_t s = 0; s < SIZE_COUNT; s++) {
+        uint32_t n = sizes[s];
+        struct play_queue q;
+        play_queue_init(&q, n);
+        play_queue_set_shuffle(&q, true, 7);
+
+        // Just before the end of the cycle so peeks cross the reshuffle
+        uint32_t id;
+        for (uint32_t i = 0; i + 2 < n; i++) play_queue_next(&q, &id);
+
+        for (uint32_t k = 0; k < n && k < 8; k++) {
+            struct play_queue walk = q;
+            uint32_t expect = play_queue_current(&walk);
+            for (uint32_t i = 0; i < k; i++) play_queue_next(&walk, &expect);
+
+            uint32_t peeked;
+            CHECK(play_queue_peek(&q, k, &peeked));
+            CHECK(peeked == expect);
+        }
+        CHECK(!play_queue_peek(&q, n, &id));
+    }
+}
+
+static void prev_retraces_next(void) {
+    struct play_queue q;
+    play_queue_init(&q, 3000);
+    play_queue_set_shuffle(&q, true, 5);
+
+    check_cycle(&q, NULL);
+
+    // The wrap starts a new order, there is nothing before its first track
+    uint32_t id;
+    CHECK(!play_queue_prev(&q, &id));
+
+    uint32_t walked[51];
+    walked[0] = play_queue_current(&q);
+    for (int i = 1; i <= 50; i++) play_queue_next(&q, &walked[i]);
+    for (int i = 49; i >= 0; i--) {
+        CHECK(play_queue_prev(&q, &id));
+        CHECK(id == walked[i]);
+    }
+    CHECK(!play_queue_prev(&q, &id));
+}
+
+// Jumping anywhere in a reshuffled cycle continues that cycle's order
+static void jump_after_reshuffle(void) {
+    for (size_t s = 0; s < SIZE_COUNT; s++) {
+        uint32_t n = sizes[s];
+        struct play_queue q;
+        play_queue_init(&q, n);
+        play_queue_set_shuffle(&q, true, 11);
+
+        uint32_t id;
+        for (uint32_t i = 0; i < n; i++) play_queue_next(&q, &id);
+
+        uint32_t *order = malloc(n * sizeof(*order));
+        struct play_queue cycle = q;
+        check_cycle(&cycle, order);
+
+        for (uint32_t i = 0; i < n; i += 1 + n / 16) {
+            struct play_queue j = q;
+            play_queue_jump(&j, order[i]);
+            CHECK(play_queue_current(&j) == order[i]);
+            if (i + 1 < n) {
+                CHECK(play_queue_next(&j, &id));
+                CHECK(id == order[i + 1]);
+            }
+            if (i > 0) {
+                struct play_queue back = q;
+                play_queue_jump(&back, order[i]);
+                CHECK(play_queue_prev(&back, &id));
+                CHECK(id == order[i - 1]);
+            }
+        }
+        free(order);
+    }
+}
+
+static void empty_queue(void) {
+    struct play_queue q;
+    play_queue_init(&q, 0);
+    play_queue_set_shuffle(&q, true, 1);
+
+    uint32_t id;
+    CHECK(!play_queue_next(&q, &id));
+    CHECK(!play_queue_prev(&q, &id));
+    CHECK(!play_queue_peek(&q, 0, &id));
+}
+
+int main(void) {
+    shuffle_is_a_permutation();
+    unshuffled_plays_in_order();
+    shuffle_keeps_current();
+    peek_matches_next();
+    prev_retraces_next();
+    jump_after_reshuffle();
+    empty_queue();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("play queue ok\n");
+    return 0;
+}